@@ -0,0 +1,121 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Counts heap allocations per notification sent through the notif_*
+ * API. malloc and friends are replaced by counting wrappers around
+ * the glibc allocator, so allocations inside libraries are counted
+ * too. Needs a session bus with a notification server.
+ */
+
+#include "notif.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ITERATIONS 10000
+#define WARMUP 100
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size)
+{
+    ++allocations;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ++allocations;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    ++allocations;
+    return __libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+    __libc_free(p);
+}
+
+static void fill(struct NotifyData *data, long i)
+{
+    notif_set_app_name(data, "backup");
+    notif_set_icon(data, "dialog-information");
+    notif_set_category(data, "transfer");
+    notif_set_summary(data, "Copying files");
+    notif_set_body(data, i % 2 ? "12 of 80 done" : "13 of 80 done");
+    notif_validate_data(data);
+}
+
+static void check(int ret)
+{
+    if (ret == -1) {
+        fprintf(stderr, "Error: %s\n", notif_get_error_message());
+        exit(1);
+    }
+}
+
+/* Returns allocations per notification */
+static double run(bool reuse, bool post, long iterations)
+{
+    struct NotifyData *data = notif_create_data();
+    unsigned long start = 0;
+    long i;
+
+    for (i = 0; i < WARMUP + iterations; ++i) {
+        if (i == WARMUP)
+            start = allocations;
+
+        if (reuse) {
+            notif_reset_data(data);
+        }
+        else {
+            notif_free_data(data);
+            data = notif_create_data();
+        }
+
+        fill(data, i);
+        check(post ? notif_post_notification(data) : notif_send_notification(data));
+    }
+
+    notif_free_data(data);
+    return (double) (allocations - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+
+    notif_set_private_connection(true);
+
+    printf("%s: send, new data:     %5.2f allocations/notification\n", BACKEND_NAME, run(false, false, iterations));
+    printf("%s: send, reused data:  %5.2f allocations/notification\n", BACKEND_NAME, run(true, false, iterations));
+    printf("%s: post, reused data:  %5.2f allocations/notification\n", BACKEND_NAME, run(true, true, iterations));
+
+    notif_close_connection();
+    return 0;
+}
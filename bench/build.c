@@ -0,0 +1,171 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+
+/*
+ * Message builder microbenchmark. Times _notif_build_message() and
+ * counts its heap allocations for summary and body of 10 B to 1 MB
+ * and several hint counts. Needs no bus, the message is dropped.
+ */
+
+#include "notif.h"
+#include "dbusimp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WARMUP 10
+#define BYTES_PER_CASE (64L * 1024 * 1024)
+#define MIN_ITERATIONS 100
+#define MAX_ITERATIONS 10000
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size)
+{
+    ++allocations;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ++allocations;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    ++allocations;
+    return __libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+    __libc_free(p);
+}
+
+static struct NotifyContext *ctx;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Summary and body of size bytes each, hints of alternating types */
+static struct NotifyData *create_data(const char *text, unsigned int hint_count)
+{
+    static const char *names[] = { "value", "desktop-entry", "transient", "x", "y" };
+    struct NotifyData *data = notif_create_data();
+    struct NotifyHint hint;
+    char name[32];
+    unsigned int i;
+
+    notif_set_app_name(data, "backup");
+    notif_set_icon(data, "dialog-information");
+    notif_set_category(data, "transfer");
+    notif_set_summary(data, text);
+    notif_set_body(data, text);
+
+    for (i = 0; i < hint_count; ++i) {
+        snprintf(name, sizeof(name), "%s-%u", names[i % 5], i);
+        hint.name = name;
+        switch (i % 3) {
+        case 0:
+            hint.type = 'i';
+            hint.value.i = (int) i;
+            break;
+        case 1:
+            hint.type = 's';
+            hint.value.s = "org.example.Backup";
+            break;
+        default:
+            hint.type = 'b';
+            hint.value.b = true;
+            break;
+        }
+        notif_add_hint(data, &hint);
+    }
+
+    notif_validate_data(data);
+    return data;
+}
+
+static void run(size_t size, unsigned int hint_count)
+{
+    struct NotifyData *data;
+    unsigned long start_allocations = 0;
+    long i, iterations;
+    double start = 0, ns;
+    char *text;
+
+    text = (char*) malloc(size + 1);
+    memset(text, 'x', size);
+    text[size] = '\0';
+    data = create_data(text, hint_count);
+
+    iterations = BYTES_PER_CASE / (long) size;
+    if (iterations < MIN_ITERATIONS)
+        iterations = MIN_ITERATIONS;
+    if (iterations > MAX_ITERATIONS)
+        iterations = MAX_ITERATIONS;
+
+    for (i = 0; i < WARMUP + iterations; ++i) {
+        if (i == WARMUP) {
+            start_allocations = allocations;
+            start = now_ns();
+        }
+        if (_notif_build_message(ctx, data) == -1) {
+            fprintf(stderr, "Error: %s\n", _notif_get_error_message(ctx));
+            exit(1);
+        }
+    }
+    ns = (now_ns() - start) / iterations;
+
+    printf("%s: %7zu B, %2u hints: %11.1f ns/op %7.2f allocs/op\n", BACKEND_NAME, size,
+           hint_count, ns, (double) (allocations - start_allocations) / iterations);
+
+    notif_free_data(data);
+    free(text);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+    static const unsigned int hint_counts[] = { 0, 4, NOTIF_MAX_HINTS };
+    unsigned int i, j;
+
+    ctx = _notif_create_context();
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (j = 0; j < sizeof(hint_counts) / sizeof(hint_counts[0]); ++j)
+            run(sizes[i], hint_counts[j]);
+    }
+
+    _notif_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# Regression checks: starts a private session bus with the stub
+# notification server and runs notify-desktop in cases that once
+# crashed or hung. Prints one line per check and returns 1 if any
+# failed.
+#
+# Environment:
+#   NOTIFY=PATH    notify-desktop to check (default ../bin/notify-desktop)
+
+BIN=$(cd "$(dirname "$0")/../bin" && pwd)
+NOTIFY=${NOTIFY:-$BIN/notify-desktop}
+FAILED=0
+
+RUNTIME=$(mktemp -d)
+export XDG_RUNTIME_DIR=$RUNTIME
+
+eval $(dbus-daemon --session --fork --print-address=1 --print-pid=1 |
+       { read address; read pid; echo "DBUS_SESSION_BUS_ADDRESS='$address'; BUS_PID=$pid"; })
+export DBUS_SESSION_BUS_ADDRESS
+
+# delayed replies keep the queues full
+STUB_PID=$("$BIN/stub-server" --delay=5) || { kill $BUS_PID; exit 1; }
+
+DAEMON_PID=
+
+trap 'kill $DAEMON_PID $STUB_PID $BUS_PID 2>/dev/null; rm -rf "$RUNTIME"' EXIT
+
+# check NAME EXPECTED ACTUAL
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1: expected $2, got $3"
+        FAILED=1
+    fi
+}
+
+# records URGENCY N writes N records of URGENCY to $RUNTIME/records
+records() {
+    seq "$2" | sed "s/^/-u $1 \"Record /; s/\$/\"/" > "$RUNTIME/records"
+}
+
+# run ARGS... runs notify-desktop on $RUNTIME/records, sets rc and ids
+run() {
+    timeout 10 "$NOTIFY" "$@" < "$RUNTIME/records" > "$RUNTIME/ids" 2> "$RUNTIME/errors"
+    rc=$?
+    ids=$(wc -l < "$RUNTIME/ids")
+}
+
+# normal and critical records are never dropped, input waits instead
+for urgency in normal critical; do
+    records $urgency 10
+    run --priority=2
+    check "priority: 10 $urgency records, queue of 2" "0 10" "$rc $ids"
+    records $urgency 100
+    run --priority=3
+    check "priority: 100 $urgency records, queue of 3" "0 100" "$rc $ids"
+done
+
+# low records beyond the queue are shed, the rest is sent
+records low 100
+run --priority=2
+shed=$(sed -n 's/.*low shed \([0-9]*\).*/\1/p' "$RUNTIME/errors")
+check "priority: 100 low records, queue of 2" "0 100" "$rc $((ids + ${shed:-0}))"
+
+{ records low 50; cat "$RUNTIME/records"; records normal 50; cat "$RUNTIME/records";
+  records critical 50; cat "$RUNTIME/records"; } > "$RUNTIME/mixed"
+mv "$RUNTIME/mixed" "$RUNTIME/records"
+run --priority=2
+shed=$(sed -n 's/.*low shed \([0-9]*\).*/\1/p' "$RUNTIME/errors")
+check "priority: 150 mixed records, queue of 2" "0 150" "$rc $((ids + ${shed:-0}))"
+
+# -R locks its file while the record lives, records must not use it
+echo 0 > "$RUNTIME/idfile"
+printf '%s\n' "-R $RUNTIME/idfile \"a\"" "-R $RUNTIME/idfile \"b\"" > "$RUNTIME/records"
+run --batch
+check "batch: two records with the same -R file" "1 0" "$rc $ids"
+
+# calls in flight when the bus goes away fail, replies on the next
+# connection belong to the records sent on it
+(
+    export XDG_RUNTIME_DIR="$RUNTIME/restart"
+    export DBUS_SESSION_BUS_ADDRESS="unix:path=$XDG_RUNTIME_DIR/bus"
+    bus() { dbus-daemon --session --address="$DBUS_SESSION_BUS_ADDRESS" --fork --print-pid=1; }
+    # cached server info, so the records are sent before any other call
+    mkdir -p "$XDG_RUNTIME_DIR/notify-desktop"
+    printf 'NDSRV1\n:1.1\nstub\n\n1.0\n1.2\nff\n' > "$XDG_RUNTIME_DIR/notify-desktop/server"
+    pids=$(bus) && pids="$pids $("$BIN/stub-server" --delay=2000)"
+    {
+        printf '"Old %s"\n' 1 2 3
+        sleep 0.5
+        kill $pids
+        rm -f "$XDG_RUNTIME_DIR/bus"
+        pids=$(bus) && pids="$pids $("$BIN/stub-server")"
+        echo "$pids" > "$XDG_RUNTIME_DIR/pids"
+        printf '"New %s"\n' 1 2 3
+    } | timeout 10 "$NOTIFY" --batch > "$RUNTIME/ids" 2> "$RUNTIME/errors"
+    echo $? > "$RUNTIME/rc"
+    kill $(cat "$XDG_RUNTIME_DIR/pids") 2>/dev/null
+)
+rc=$(cat "$RUNTIME/rc")
+ids=$(wc -l < "$RUNTIME/ids")
+errors=$(wc -l < "$RUNTIME/errors")
+# the first new record may be the one to find the old connection gone
+[ $errors -ge 3 ] && errors=3+
+check "batch: bus restarted with calls in flight" "1 3+ 6" "$rc $errors $((ids + $(wc -l < "$RUNTIME/errors")))"
+
+# the daemon opens relative paths of its clients from another directory
+(cd / && exec "$NOTIFY" --daemon 2>/dev/null) &
+DAEMON_PID=$!
+sleep 0.2
+mkdir "$RUNTIME/images"
+head -c 64 /dev/zero > "$RUNTIME/images/image.rgb"
+(cd "$RUNTIME/images" && timeout 10 "$NOTIFY" -I 4x4:image.rgb "Image" > /dev/null 2>&1)
+check "daemon: relative image path" "0" "$?"
+kill $DAEMON_PID
+DAEMON_PID=
+
+# producers share a small ring, every notification completes once and in order
+for stress in "$BIN"/sender-stress-*; do
+    # ThreadSanitizer makes the exit code non-zero on a data race
+    out=$(timeout 60 "$stress" 8 4000 256 2>&1)
+    check "sender: $(echo "$out" | tail -1)" "0" "$?"
+done
+
+exit $FAILED
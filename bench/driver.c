@@ -0,0 +1,144 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Runs a command many times with fixed concurrency and reports
+ * notifications per second, latency percentiles and peak RSS:
+ *
+ *   driver [-n TOTAL] [-c CONCURRENCY] [-m PER_RUN] COMMAND [ARG...]
+ *
+ * PER_RUN is the number of notifications one invocation sends.
+ */
+
+#define _POSIX_C_SOURCE 200809
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Run {
+    pid_t pid;
+    double start;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+static pid_t spawn(char **argv)
+{
+    pid_t pid = fork();
+    int fd;
+
+    if (pid == 0) {
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+int main(int argc, char **argv)
+{
+    struct Run *runs;
+    struct rusage usage;
+    double *latencies, start, elapsed;
+    long total = 1000, concurrency = 1, per_run = 1, started = 0, done = 0, failed = 0, maxrss = 0;
+    int opt, status, i;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "+n:c:m:")) != -1) {
+        if (opt == 'n')
+            total = atol(optarg);
+        else if (opt == 'c')
+            concurrency = atol(optarg);
+        else if (opt == 'm')
+            per_run = atol(optarg);
+        else
+            return 1;
+    }
+
+    if (optind == argc || total < 1 || concurrency < 1) {
+        fprintf(stderr, "Usage: %s [-n TOTAL] [-c CONCURRENCY] [-m PER_RUN] COMMAND [ARG...]\n", argv[0]);
+        return 1;
+    }
+
+    runs = (struct Run*) calloc(concurrency, sizeof(struct Run));
+    latencies = (double*) calloc(total, sizeof(double));
+
+    start = now_ms();
+
+    while (done < total) {
+        for (i = 0; i < concurrency && started < total; ++i) {
+            if (runs[i].pid != 0)
+                continue;
+            runs[i].start = now_ms();
+            runs[i].pid = spawn(argv + optind);
+            ++started;
+        }
+
+        pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0)
+            break;
+
+        for (i = 0; i < concurrency && runs[i].pid != pid; ++i)
+            ;
+        if (i == concurrency)
+            continue;
+
+        latencies[done++] = now_ms() - runs[i].start;
+        runs[i].pid = 0;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ++failed;
+        if (usage.ru_maxrss > maxrss)
+            maxrss = usage.ru_maxrss;
+    }
+
+    elapsed = now_ms() - start;
+    qsort(latencies, done, sizeof(double), compare);
+
+    printf("%8.0f notif/s   p50 %7.2f ms   p99 %7.2f ms   max %7.2f ms   rss %5li KB   failed %li\n",
+           done * per_run / elapsed * 1000.0,
+           latencies[done / 2],
+           latencies[done * 99 / 100],
+           latencies[done - 1],
+           maxrss, failed);
+
+    free(runs);
+    free(latencies);
+    return 0;
+}
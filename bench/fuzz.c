@@ -0,0 +1,173 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+
+/*
+ * Fuzz target for the message builder. The input is split into
+ * NotifyData fields, which are set as given (invalid UTF-8, markup,
+ * huge strings) and built with _notif_build_message().
+ *
+ * Input: one byte of flags, one of server capabilities (bit 6 of the
+ * flags adds sound), four of replaces_id, then NUL separated app_name, icon, category, summary,
+ * body, tag, and pairs of hint (type character and name) and value,
+ * or of action key and label when flags has bit 7 set.
+ *
+ * Built for libFuzzer by default. With -DFUZZ_STANDALONE it reads
+ * the input from the file given or stdin, for AFL and for replaying
+ * crashes.
+ */
+
+#include "notif.h"
+#include "dbusimp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEADER_SIZE 6
+
+/* Returns the next field and advances past it, NULL at the end */
+static const char *next_field(const char **pos, const char *end)
+{
+    const char *field = *pos;
+    const char *nul;
+
+    if (field >= end)
+        return NULL;
+
+    nul = (const char*) memchr(field, '\0', end - field);
+    *pos = nul != NULL ? nul + 1 : end;
+    return field;
+}
+
+static void add_hint(struct NotifyData *data, const char *name, const char *value)
+{
+    struct NotifyHint hint;
+
+    hint.name = name + 1;
+    hint.type = name[0];
+    switch (hint.type) {
+    case 'i':
+        hint.value.i = atoi(value);
+        break;
+    case 'd':
+        hint.value.d = atof(value);
+        break;
+    case 'y':
+        hint.value.y = (unsigned char) value[0];
+        break;
+    case 'b':
+        hint.value.b = value[0] != '\0';
+        break;
+    default:
+        hint.type = 's';
+        hint.value.s = value;
+        break;
+    }
+    notif_add_hint(data, &hint);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *input, size_t size);
+
+int LLVMFuzzerTestOneInput(const unsigned char *input, size_t size)
+{
+    static struct NotifyContext *ctx = NULL;
+    struct NotifyServerInfo info;
+    struct NotifyData *data;
+    const char *pos, *end, *name, *value;
+    char *copy;
+
+    if (size < HEADER_SIZE)
+        return 0;
+
+    /* fields are C strings, the last one needs a terminator */
+    copy = (char*) malloc(size + 1);
+    memcpy(copy, input, size);
+    copy[size] = '\0';
+    pos = copy + HEADER_SIZE;
+    end = copy + size;
+
+    if (ctx == NULL)
+        ctx = _notif_create_context();
+
+    memset(&info, 0, sizeof(info));
+    strcpy(info.owner, ":1.1");
+    info.capabilities = input[1] | (input[0] & 0x40u) << 2;
+    _notif_set_server_info(ctx, &info);
+
+    data = notif_create_data();
+    notif_set_urgency(data, input[0] & 3);
+    notif_set_expire_time(data, (input[0] & 0x7f) / 4 - 1);
+    notif_set_replaces_id(data, (unsigned int) input[2] | (unsigned int) input[3] << 8 |
+                                (unsigned int) input[4] << 16 | (unsigned int) input[5] << 24);
+
+    if ((value = next_field(&pos, end)) != NULL)
+        notif_set_app_name(data, value);
+    if ((value = next_field(&pos, end)) != NULL)
+        notif_set_icon(data, value);
+    if ((value = next_field(&pos, end)) != NULL)
+        notif_set_category(data, value);
+    if ((value = next_field(&pos, end)) != NULL)
+        notif_set_summary(data, value);
+    if ((value = next_field(&pos, end)) != NULL)
+        notif_set_body(data, value);
+    if ((value = next_field(&pos, end)) != NULL)
+        notif_set_tag(data, value);
+
+    while ((name = next_field(&pos, end)) != NULL && (value = next_field(&pos, end)) != NULL) {
+        if (input[0] & 0x80)
+            notif_add_action(data, name, value);
+        else if (name[0] != '\0')
+            add_hint(data, name, value);
+    }
+
+    if (notif_validate_data(data))
+        _notif_build_message(ctx, data);
+    _notif_free_error_message(ctx);
+
+    notif_free_data(data);
+    free(copy);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv)
+{
+    FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    unsigned char *input = NULL;
+    size_t size = 0, capacity = 0, n;
+
+    if (file == NULL) {
+        perror("Could not open the input");
+        return 1;
+    }
+
+    do {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            input = (unsigned char*) realloc(input, capacity);
+        }
+        n = fread(input + size, 1, capacity - size, file);
+        size += n;
+    } while (n > 0);
+
+    LLVMFuzzerTestOneInput(input, size);
+    free(input);
+    return 0;
+}
+#endif
@@ -0,0 +1,142 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Marshalling microbenchmark. The backend source is included directly
+ * so its internal message builder can be timed without a bus.
+ *
+ * Build with -DBACKEND_WIRE for the wire backend, libdbus otherwise.
+ */
+
+#ifdef BACKEND_WIRE
+#include "../src/wire.c"
+#define BACKEND_NAME "wire"
+#else
+#include "../src/dbusimp.c"
+#define BACKEND_NAME "dbus"
+#endif
+
+#include <time.h>
+
+#define ITERATIONS 1000000
+
+static struct NotifyContext *ctx;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct NotifyData *create_data(const char *app_name, const char *summary,
+                                      const char *body, unsigned int replaces_id)
+{
+    struct NotifyData *data = notif_create_data();
+
+    notif_set_app_name(data, app_name);
+    notif_set_icon(data, "dialog-information");
+    notif_set_category(data, "transfer");
+    notif_set_summary(data, summary);
+    notif_set_body(data, body);
+    notif_set_replaces_id(data, replaces_id);
+    notif_validate_data(data);
+    return data;
+}
+
+/* Adds the hints of a progress notification */
+static struct NotifyData *add_hints(struct NotifyData *data, int value)
+{
+    struct NotifyHint hint;
+
+    hint.name = "value";
+    hint.type = 'i';
+    hint.value.i = value;
+    notif_add_hint(data, &hint);
+
+    hint.name = "desktop-entry";
+    hint.type = 's';
+    hint.value.s = "org.example.Backup";
+    notif_add_hint(data, &hint);
+
+    hint.name = "transient";
+    hint.type = 'b';
+    hint.value.b = true;
+    notif_add_hint(data, &hint);
+    return data;
+}
+
+static bool build(struct NotifyData *data)
+{
+#ifdef BACKEND_WIRE
+    return create_message(ctx, &ctx->out, data, 0);
+#else
+    DBusMessage *msg = create_message(ctx, data);
+
+    if (msg == NULL)
+        return false;
+    dbus_message_unref(msg);
+    return true;
+#endif
+}
+
+/* Alternates between two notifications, returns ns per message */
+static double run(struct NotifyData *a, struct NotifyData *b, long iterations)
+{
+    double start;
+    long i;
+
+    start = now_ns();
+    for (i = 0; i < iterations; ++i) {
+        if (!build(i % 2 ? b : a)) {
+            fprintf(stderr, "Error: %s\n", _notif_get_error_message(ctx));
+            exit(1);
+        }
+    }
+    return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    struct NotifyData *a, *b, *c, *d, *e, *f;
+    long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+
+    ctx = _notif_create_context();
+
+    a = create_data("backup", "Copying files", "12 of 80 done", 0);
+    b = create_data("backup", "Copying files", "13 of 80 done", 7);
+    c = create_data("monitor", "Load high", "load average 12.5", 0);
+    d = add_hints(create_data("backup", "Copying files", "12 of 80 done", 0), 15);
+    e = add_hints(create_data("backup", "Copying files", "13 of 80 done", 7), 15);
+    f = add_hints(create_data("backup", "Copying files", "13 of 80 done", 7), 16);
+
+    printf("%s: same fixed fields:      %6.1f ns/message\n", BACKEND_NAME, run(a, b, iterations));
+    printf("%s: changing fixed fields:  %6.1f ns/message\n", BACKEND_NAME, run(a, c, iterations));
+    printf("%s: same hints:             %6.1f ns/message\n", BACKEND_NAME, run(d, e, iterations));
+    printf("%s: changing hint value:    %6.1f ns/message\n", BACKEND_NAME, run(d, f, iterations));
+
+    notif_free_data(a);
+    notif_free_data(b);
+    notif_free_data(c);
+    notif_free_data(d);
+    notif_free_data(e);
+    notif_free_data(f);
+    _notif_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# End-to-end benchmark: starts a private session bus with the stub
+# notification server and drives notify-desktop at several concurrency
+# levels, directly, through --batch and through --daemon. Then counts
+# allocations per notification sent through the library.
+#
+# Environment:
+#   TOTAL=N        invocations per level (default 2000)
+#   LEVELS="..."   concurrency levels (default "1 4 16 64")
+#   STUB_ARGS=".." stub-server arguments, e.g. "--delay=20 --error-every=100"
+
+BIN=$(cd "$(dirname "$0")/../bin" && pwd)
+NOTIFY=${NOTIFY:-$BIN/notify-desktop}
+TOTAL=${TOTAL:-2000}
+LEVELS=${LEVELS:-"1 4 16 64"}
+
+RUNTIME=$(mktemp -d)
+export XDG_RUNTIME_DIR=$RUNTIME
+
+eval $(dbus-daemon --session --fork --print-address=1 --print-pid=1 |
+       { read address; read pid; echo "DBUS_SESSION_BUS_ADDRESS='$address'; BUS_PID=$pid"; })
+export DBUS_SESSION_BUS_ADDRESS
+
+STUB_PID=$("$BIN/stub-server" $STUB_ARGS) || { kill $BUS_PID; exit 1; }
+DAEMON_PID=
+
+trap 'kill $DAEMON_PID $STUB_PID $BUS_PID 2>/dev/null; rm -rf "$RUNTIME"' EXIT
+
+echo "stub-server $STUB_ARGS"
+
+for level in $LEVELS; do
+    printf "direct  c=%-3s " "$level"
+    "$BIN/driver" -n "$TOTAL" -c "$level" "$NOTIFY" "Benchmark" "Body of benchmark notification"
+done
+
+seq "$TOTAL" | sed 's/^/"Benchmark" "Record /; s/$/"/' > "$RUNTIME/batch"
+printf "batch   n=%-5s" "$TOTAL"
+"$BIN/driver" -n 1 -c 1 -m "$TOTAL" "$NOTIFY" --batch="$RUNTIME/batch"
+
+"$NOTIFY" --daemon 2>/dev/null &
+DAEMON_PID=$!
+sleep 0.2
+
+for level in $LEVELS; do
+    printf "daemon  c=%-3s " "$level"
+    "$BIN/driver" -n "$TOTAL" -c "$level" "$NOTIFY" "Benchmark" "Body of benchmark notification"
+done
+
+for bench in "$BIN"/alloc-bench-*; do
+    "$bench"
+done
@@ -0,0 +1,138 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+
+/*
+ * Stress test of the submission ring. Several producer threads submit
+ * notifications through one sender with a small ring, retrying while
+ * it is full. Checks that every notification completes exactly once
+ * and that each producer's notifications complete in the order they
+ * were submitted. Build with -fsanitize=thread to check the ring for
+ * data races. Needs a session bus with a notification server.
+ *
+ *   sender-stress [PRODUCERS] [NOTIFICATIONS] [CAPACITY]
+ */
+
+#include "notif.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_PRODUCERS 64
+
+struct Producer {
+    pthread_t thread;
+    unsigned int index;
+    long count;
+    long completed;
+    long next;
+};
+
+static struct NotifySender *sender;
+static struct Producer producers[MAX_PRODUCERS];
+static atomic_long completions;
+static atomic_long errors;
+static atomic_long out_of_order;
+static atomic_long full;
+
+/* user_data is the producer, the notification number is in replaces_id */
+static void sent(struct NotifyData *data, struct NotifyStatus status, void *user_data)
+{
+    struct Producer *producer = (struct Producer*) user_data;
+    long number = (long) notif_get_replaces_id(data) - 1;
+
+    /* callbacks run on the sender thread only, producer fields are its own */
+    if (number != producer->next)
+        atomic_fetch_add(&out_of_order, 1);
+    producer->next = number + 1;
+    ++producer->completed;
+
+    if (status.id == -1)
+        atomic_fetch_add(&errors, 1);
+    atomic_fetch_add(&completions, 1);
+}
+
+static void *produce(void *arg)
+{
+    struct Producer *producer = (struct Producer*) arg;
+    struct NotifyData *data;
+    long i;
+
+    for (i = 0; i < producer->count; ++i) {
+        data = notif_create_data();
+        notif_set_app_name(data, "sender-stress");
+        notif_set_summary(data, "Stress");
+        notif_set_body(data, "Submitted from a producer thread");
+        /* carries the number to the callback */
+        notif_set_replaces_id(data, (unsigned int) i + 1);
+        notif_validate_data(data);
+
+        while (notif_submit_notification(sender, data, sent, producer) == -1) {
+            atomic_fetch_add(&full, 1);
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int count = argc > 1 ? (unsigned int) atoi(argv[1]) : 8;
+    long total = argc > 2 ? atol(argv[2]) : 4000;
+    unsigned int capacity = argc > 3 ? (unsigned int) atoi(argv[3]) : 256;
+    struct NotifyContext *ctx;
+    long lost = 0;
+    unsigned int i;
+
+    if (count < 1 || count > MAX_PRODUCERS || total < count || capacity < 1) {
+        fprintf(stderr, "Usage: %s [PRODUCERS] [NOTIFICATIONS] [CAPACITY]\n", argv[0]);
+        return 2;
+    }
+
+    ctx = notif_context_create();
+    sender = ctx != NULL ? notif_sender_create(ctx, capacity) : NULL;
+    if (sender == NULL) {
+        fprintf(stderr, "Cannot create sender\n");
+        return 1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        producers[i].index = i;
+        producers[i].count = total / count + (i < total % count);
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+    for (i = 0; i < count; ++i)
+        pthread_join(producers[i].thread, NULL);
+
+    /* sends the rest and joins the sender thread */
+    notif_sender_free(sender);
+
+    for (i = 0; i < count; ++i)
+        lost += producers[i].count - producers[i].completed;
+
+    printf("%s: %u producers, %ld notifications, ring of %u: %ld completed, %ld lost, "
+           "%ld out of order, %ld errors, %ld retries on full ring\n",
+           BACKEND_NAME, count, total, capacity, atomic_load(&completions), lost,
+           atomic_load(&out_of_order), atomic_load(&errors), atomic_load(&full));
+
+    return lost == 0 && atomic_load(&completions) == total &&
+           atomic_load(&out_of_order) == 0 && atomic_load(&errors) == 0 ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Minimal org.freedesktop.Notifications server for benchmarks.
+ *
+ * Notify returns increasing IDs (or replaces_id). Replies can be
+ * delayed without blocking other calls, and failures injected:
+ *
+ *   stub-server [--delay=MS] [--error-every=N] [--drop-every=N]
+ *
+ * Forks once the name is acquired and prints the server PID.
+ */
+
+#define DBUS_API_SUBJECT_TO_CHANGE
+#include <dbus/dbus.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DELAYED 65536
+
+struct DelayedReply {
+    DBusMessage *reply;
+    long due;
+};
+
+static struct DelayedReply _delayed[MAX_DELAYED];
+static unsigned int _delayed_head = 0;
+static unsigned int _delayed_count = 0;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static DBusMessage *handle_call(DBusMessage *msg, int error_every, int drop_every)
+{
+    static unsigned long calls = 0;
+    static dbus_uint32_t last_id = 0;
+    static const char *caps[] = { "actions", "body", "body-markup", "persistence" };
+    static const char *info[] = { "stub-server", "notify-desktop", "0.1", "1.2" };
+    DBusMessage *reply;
+    DBusMessageIter args, array;
+    dbus_uint32_t id = 0;
+    unsigned int i;
+
+    if (dbus_message_is_method_call(msg, "org.freedesktop.Notifications", "Notify")) {
+        ++calls;
+        if (drop_every > 0 && calls % drop_every == 0)
+            return NULL;
+        if (error_every > 0 && calls % error_every == 0)
+            return dbus_message_new_error(msg, "org.freedesktop.Notifications.Error.Injected",
+                                          "Injected failure");
+
+        if (dbus_message_iter_init(msg, &args) && dbus_message_iter_next(&args) &&
+            dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_UINT32)
+            dbus_message_iter_get_basic(&args, &id);
+        if (id == 0)
+            id = ++last_id;
+
+        reply = dbus_message_new_method_return(msg);
+        dbus_message_append_args(reply, DBUS_TYPE_UINT32, &id, DBUS_TYPE_INVALID);
+        return reply;
+    }
+
+    if (dbus_message_is_method_call(msg, "org.freedesktop.Notifications", "GetCapabilities")) {
+        reply = dbus_message_new_method_return(msg);
+        dbus_message_iter_init_append(reply, &args);
+        dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &array);
+        for (i = 0; i < sizeof(caps) / sizeof(caps[0]); ++i)
+            dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &caps[i]);
+        dbus_message_iter_close_container(&args, &array);
+        return reply;
+    }
+
+    if (dbus_message_is_method_call(msg, "org.freedesktop.Notifications", "GetServerInformation")) {
+        reply = dbus_message_new_method_return(msg);
+        dbus_message_append_args(reply,
+                                 DBUS_TYPE_STRING, &info[0], DBUS_TYPE_STRING, &info[1],
+                                 DBUS_TYPE_STRING, &info[2], DBUS_TYPE_STRING, &info[3],
+                                 DBUS_TYPE_INVALID);
+        return reply;
+    }
+
+    if (dbus_message_is_method_call(msg, "org.freedesktop.Notifications", "CloseNotification"))
+        return dbus_message_new_method_return(msg);
+
+    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, "Unknown method");
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    DBusConnection *conn;
+    DBusMessage *msg, *reply;
+    DBusError err;
+    int delay = 0, error_every = 0, drop_every = 0, timeout, i;
+    pid_t pid;
+
+    for (i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--delay=", 8) == 0)
+            delay = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--error-every=", 14) == 0)
+            error_every = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--drop-every=", 13) == 0)
+            drop_every = atoi(argv[i] + 13);
+        else {
+            fprintf(stderr, "Usage: %s [--delay=MS] [--error-every=N] [--drop-every=N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    dbus_error_init(&err);
+    conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+    if (conn == NULL) {
+        fprintf(stderr, "Connection Error (%s)\n", err.message);
+        return 1;
+    }
+
+    if (dbus_bus_request_name(conn, "org.freedesktop.Notifications",
+                              DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "Cannot own org.freedesktop.Notifications\n");
+        return 1;
+    }
+
+    pid = fork();
+    if (pid != 0) {
+        printf("%i\n", (int) pid);
+        return pid < 0;
+    }
+    fclose(stdout);
+
+    for (;;) {
+        timeout = -1;
+        if (_delayed_count > 0) {
+            timeout = _delayed[_delayed_head].due - now_ms();
+            if (timeout < 0)
+                timeout = 0;
+        }
+
+        if (!dbus_connection_read_write(conn, timeout))
+            break;
+
+        while ((msg = dbus_connection_pop_message(conn)) != NULL) {
+            reply = handle_call(msg, error_every, drop_every);
+            dbus_message_unref(msg);
+            if (reply == NULL)
+                continue;
+
+            if (delay == 0 || _delayed_count == MAX_DELAYED) {
+                dbus_connection_send(conn, reply, NULL);
+                dbus_message_unref(reply);
+                continue;
+            }
+
+            /* delay is constant, so replies become due in order */
+            _delayed[(_delayed_head + _delayed_count) % MAX_DELAYED].reply = reply;
+            _delayed[(_delayed_head + _delayed_count) % MAX_DELAYED].due = now_ms() + delay;
+            ++_delayed_count;
+        }
+
+        while (_delayed_count > 0 && _delayed[_delayed_head].due <= now_ms()) {
+            dbus_connection_send(conn, _delayed[_delayed_head].reply, NULL);
+            dbus_message_unref(_delayed[_delayed_head].reply);
+            _delayed_head = (_delayed_head + 1) % MAX_DELAYED;
+            --_delayed_count;
+        }
+    }
+
+    return 0;
+}
@@ -41,9 +41,29 @@ function notify_ {
 }
 
 
+#
+# Notifications of one host grouped by tag, without tracking IDs
+#
+# - each alert replaces the previous one with the same tag
+# - host_clear closes all alerts of the host at once
+
+function host_alert {
+    host=$1
+    shift
+    notify-desktop --tag="$host/$1" "$@" > /dev/null
+}
+
+function host_clear {
+    notify-desktop --close-tag="$1"
+}
+
+
 #
 # You can use both functions the same way as notify-desktop
 #
 # notify -i up "Show icon" "Up icon is shown in notification"
 # notify_ "Testing notification"
 #
+# host_alert web1 disk "Disk full" "/var is at 98%"
+# host_clear web1
+#
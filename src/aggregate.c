@@ -0,0 +1,305 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Aggregation of event bursts read from stdin.
+ *
+ * Events are grouped by tag, app_name or category. A group stays open
+ * while its events arrive within window ms of each other and is shown
+ * as one notification, "37 × summary" with summary and body of the
+ * newest event. The first event is sent right away, later ones update
+ * the notification through replaces_id at most once per
+ * AGGREGATE_UPDATE_MS, so the server sees a bounded number of calls
+ * however large the burst. A group with changes not yet shown gets a
+ * last update when it closes. Events without the key are sent as they
+ * are.
+ */
+
+#define _GNU_SOURCE
+#include "aggregate.h"
+#include "batch.h"
+#include "options.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define AGGREGATE_UPDATE_MS 1000
+
+struct Group {
+    char *key;
+    char *summary;
+    int id;
+    unsigned long count;
+    long last_event;
+    long last_sent;
+    bool dirty;
+    struct NotifyData *latest;
+};
+
+static struct Group *_aggregate_groups = NULL;
+static size_t _aggregate_count = 0;
+static size_t _aggregate_size = 0;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int wait_ms(long due)
+{
+    long ms = due - now_ms();
+
+    return ms < 0 ? 0 : (int) ms;
+}
+
+static const char *group_key(struct NotifyData *data, int key)
+{
+    const char *value;
+
+    if (key == AGGREGATE_BY_APP_NAME)
+        value = notif_get_app_name(data);
+    else if (key == AGGREGATE_BY_CATEGORY)
+        value = notif_get_category(data);
+    else
+        value = notif_get_tag(data);
+
+    return value != NULL && value[0] != '\0' ? value : NULL;
+}
+
+static struct Group *find_group(const char *key)
+{
+    struct Group *group, *groups;
+    size_t i;
+
+    for (i = 0; i < _aggregate_count; ++i) {
+        if (strcmp(_aggregate_groups[i].key, key) == 0)
+            return &_aggregate_groups[i];
+    }
+
+    if (_aggregate_count == _aggregate_size) {
+        _aggregate_size = _aggregate_size ? _aggregate_size * 2 : 16;
+        groups = (struct Group*) realloc(_aggregate_groups, _aggregate_size * sizeof(struct Group));
+        if (groups == NULL)
+            return NULL;
+        _aggregate_groups = groups;
+    }
+
+    group = &_aggregate_groups[_aggregate_count];
+    memset(group, 0, sizeof(*group));
+    group->key = strdup(key);
+    if (group->key == NULL)
+        return NULL;
+
+    ++_aggregate_count;
+    return group;
+}
+
+static void close_group(size_t index)
+{
+    struct Group *group = &_aggregate_groups[index];
+
+    free(group->key);
+    free(group->summary);
+    notif_free_data(group->latest);
+    _aggregate_groups[index] = _aggregate_groups[--_aggregate_count];
+}
+
+/* Sends data without aggregating, returns 1 on failure */
+static int send_data(struct NotifyData *data)
+{
+    int id = notif_send_notification(data);
+
+    if (id == -1) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        return 1;
+    }
+
+    fprintf(notif_get_id_file(data), "%i\n", id);
+    fflush(notif_get_id_file(data));
+    return 0;
+}
+
+/* Shows the count and the newest event of group, returns 1 on failure */
+static int send_group(struct Group *group, long now)
+{
+    struct NotifyData *data = group->latest;
+    char *summary = NULL;
+    int id;
+
+    if (group->count > 1) {
+        if (asprintf(&summary, "%lu × %s", group->count, group->summary) < 0) {
+            fprintf(errout, "Error: Out Of Memory!\n");
+            return 1;
+        }
+        notif_set_summary(data, summary);
+        free(summary);
+    }
+
+    notif_set_replaces_id(data, group->id);
+    group->last_sent = now;
+    group->dirty = false;
+
+    id = notif_send_notification(data);
+    if (id == -1) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        return 1;
+    }
+
+    group->id = id;
+    fprintf(notif_get_id_file(data), "%i\n", id);
+    fflush(notif_get_id_file(data));
+    return 0;
+}
+
+static void handle_event(struct NotifyData *data, int window, int key, int *ret)
+{
+    const char *value = group_key(data, key);
+    struct Group *group;
+    long now = now_ms();
+    char *summary;
+
+    group = value != NULL ? find_group(value) : NULL;
+    summary = group != NULL ? strdup(notif_get_summary(data)) : NULL;
+    if (group == NULL || summary == NULL) {
+        free(summary);
+        *ret |= send_data(data);
+        notif_free_data(data);
+        return;
+    }
+
+    /* a group that went quiet for a whole window starts over */
+    if (group->count > 0 && now - group->last_event >= window) {
+        if (group->dirty)
+            *ret |= send_group(group, now);
+        group->count = 0;
+        group->id = 0;
+    }
+
+    free(group->summary);
+    notif_free_data(group->latest);
+    group->summary = summary;
+    group->latest = data;
+    group->last_event = now;
+    group->dirty = true;
+
+    if (group->count++ == 0 || now - group->last_sent >= AGGREGATE_UPDATE_MS)
+        *ret |= send_group(group, now);
+}
+
+/*
+ * Sends due updates and closes groups that went quiet. Returns time
+ * when the next update or close is due, or -1 when no group is open.
+ * At end of input all changes are shown right away.
+ */
+static long send_due(int window, bool eof, int *ret)
+{
+    struct Group *group;
+    long now = now_ms(), next = -1, due;
+    size_t i = 0;
+
+    while (i < _aggregate_count) {
+        group = &_aggregate_groups[i];
+
+        if (group->dirty && (eof || group->last_sent + AGGREGATE_UPDATE_MS <= now))
+            *ret |= send_group(group, now);
+
+        if (eof || group->last_event + window <= now) {
+            close_group(i);
+            continue;
+        }
+
+        due = group->last_event + window;
+        if (group->dirty && group->last_sent + AGGREGATE_UPDATE_MS < due)
+            due = group->last_sent + AGGREGATE_UPDATE_MS;
+        if (next == -1 || due < next)
+            next = due;
+        ++i;
+    }
+
+    return next;
+}
+
+int aggregate_run(int window, int key)
+{
+    struct BatchInput input;
+    struct NotifyData *data;
+    struct pollfd pfd;
+    char *line;
+    long next;
+    int parsed, lineno = 0, ret = 0;
+
+    batch_input_init(&input, STDIN_FILENO);
+
+    for (;;) {
+        next = send_due(window, input.eof, &ret);
+        if (input.eof)
+            break;
+
+        pfd.fd = input.fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, next == -1 ? -1 : wait_ms(next)) <= 0)
+            continue;
+
+        /* show what was aggregated before giving up */
+        if (batch_input_fill(&input) < 0) {
+            perror("Could not read input");
+            input.eof = true;
+            ret = 1;
+            continue;
+        }
+
+        while ((line = batch_input_line(&input)) != NULL) {
+            ++lineno;
+
+            data = notif_create_data();
+            if (data == NULL) {
+                fprintf(errout, "Line %i: Out Of Memory!\n", lineno);
+                ret = 1;
+                continue;
+            }
+            parsed = parse_record(line, data);
+
+            if (parsed == PARSE_OK) {
+                handle_event(data, window, key, &ret);
+                continue;
+            }
+
+            if (parsed != PARSE_EMPTY) {
+                fprintf(errout, "Line %i: invalid record\n", lineno);
+                ret = 1;
+            }
+            notif_free_data(data);
+        }
+    }
+
+    while (_aggregate_count > 0)
+        close_group(0);
+    free(_aggregate_groups);
+    batch_input_free(&input);
+
+    return ret;
+}
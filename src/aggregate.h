@@ -0,0 +1,28 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#define AGGREGATE_BY_TAG 0
+#define AGGREGATE_BY_APP_NAME 1
+#define AGGREGATE_BY_CATEGORY 2
+
+int aggregate_run(int window, int key);
+
+#endif /* AGGREGATE_H */
@@ -0,0 +1,309 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#define _GNU_SOURCE
+#include "batch.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void batch_input_init(struct BatchInput *input, int fd)
+{
+    input->fd = fd;
+    input->buf = NULL;
+    input->len = 0;
+    input->size = 0;
+    input->start = 0;
+    input->eof = false;
+}
+
+void batch_input_free(struct BatchInput *input)
+{
+    free(input->buf);
+    input->buf = NULL;
+}
+
+/*
+ * Reads what is available on the descriptor. Returns -1 on error,
+ * 0 on end of file and number of bytes read otherwise.
+ */
+int batch_input_fill(struct BatchInput *input)
+{
+    char *buf;
+    ssize_t ret;
+
+    if (input->start > 0) {
+        memmove(input->buf, input->buf + input->start, input->len - input->start);
+        input->len -= input->start;
+        input->start = 0;
+    }
+
+    if (input->size - input->len < 4096) {
+        buf = (char*) realloc(input->buf, input->size + 65536);
+        if (buf == NULL)
+            return -1;
+        input->buf = buf;
+        input->size += 65536;
+    }
+
+    do {
+        ret = read(input->fd, input->buf + input->len, input->size - input->len - 1);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return -1;
+    if (ret == 0)
+        input->eof = true;
+
+    input->len += ret;
+    return ret;
+}
+
+/*
+ * Returns next complete line without newline, or NULL when there is
+ * none. After end of file the unterminated last line is returned too.
+ */
+char *batch_input_line(struct BatchInput *input)
+{
+    char *line, *end;
+
+    if (input->start == input->len)
+        return NULL;
+
+    line = input->buf + input->start;
+    end = memchr(line, '\n', input->len - input->start);
+
+    if (end == NULL) {
+        if (!input->eof)
+            return NULL;
+        end = input->buf + input->len;
+        input->start = input->len;
+    }
+    else {
+        input->start = end - input->buf + 1;
+    }
+
+    *end = '\0';
+    return line;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+ * Splits line into arguments in place. Supports single quotes,
+ * double quotes and backslash escapes (outside single quotes).
+ *
+ * Returns number of arguments, or -1 on unterminated quote or
+ * when there are more than size arguments.
+ */
+int batch_split_line(char *line, char **argv, int size)
+{
+    char *in = line;
+    char *out = line;
+    char quote;
+    int argc = 0;
+
+    for (;;) {
+        while (is_space(*in))
+            ++in;
+
+        if (*in == '\0' || *in == '#')
+            break;
+
+        if (argc == size)
+            return -1;
+
+        argv[argc++] = out;
+        quote = '\0';
+
+        for (; *in != '\0'; ++in) {
+            if (quote == '\0' && is_space(*in)) {
+                ++in;
+                break;
+            }
+            if (quote == '\0' && (*in == '\'' || *in == '"')) {
+                quote = *in;
+                continue;
+            }
+            if (quote != '\0' && *in == quote) {
+                quote = '\0';
+                continue;
+            }
+            if (quote != '\'' && *in == '\\' && in[1] != '\0') {
+                ++in;
+                if (*in == 'n')
+                    *out++ = '\n';
+                else
+                    *out++ = *in;
+                continue;
+            }
+            *out++ = *in;
+        }
+
+        if (quote != '\0')
+            return -1;
+
+        *out++ = '\0';
+    }
+
+    return argc;
+}
+
+static void write_quoted(FILE *file, const char *arg)
+{
+    fputc('\'', file);
+    for (; *arg != '\0'; ++arg) {
+        if (*arg == '\'')
+            fputs("'\\''", file);
+        else if (*arg == '\n')
+            fputs("'\\n'", file);
+        else
+            fputc(*arg, file);
+    }
+    fputc('\'', file);
+}
+
+static void write_argument(FILE *file, const char *arg)
+{
+    fputc(' ', file);
+    write_quoted(file, arg);
+}
+
+/*
+ * Writes path made absolute, the reader (the daemon) may run in
+ * another directory. Paths that do not resolve are written as given,
+ * the reader then reports them.
+ */
+static void write_path(FILE *file, const char *path)
+{
+    char *resolved = path[0] != '/' ? realpath(path, NULL) : NULL;
+
+    write_quoted(file, resolved != NULL ? resolved : path);
+    free(resolved);
+}
+
+/* Icons and image-path hints are paths only when relative with a directory */
+static bool relative_path(const char *value)
+{
+    return value[0] != '/' && strchr(value, '/') != NULL && strstr(value, "://") == NULL;
+}
+
+/* String hints holding a file path by the spec, others are sent as given */
+static bool path_hint(const struct NotifyHint *hint)
+{
+    if (strcmp(hint->name, "sound-file") == 0)
+        return hint->value.s[0] != '\0';
+    return (strcmp(hint->name, "image-path") == 0 || strcmp(hint->name, "image_path") == 0) &&
+           relative_path(hint->value.s);
+}
+
+static void write_hint(FILE *file, const struct NotifyHint *hint)
+{
+    fputs(" -H", file);
+
+    switch (hint->type) {
+    case 'i':
+        fputs(" int:", file);
+        write_quoted(file, hint->name);
+        fprintf(file, ":%i", hint->value.i);
+        break;
+    case 'd':
+        fputs(" double:", file);
+        write_quoted(file, hint->name);
+        fprintf(file, ":%.17g", hint->value.d);
+        break;
+    case 's':
+        fputs(" string:", file);
+        write_quoted(file, hint->name);
+        fputc(':', file);
+        if (path_hint(hint))
+            write_path(file, hint->value.s);
+        else
+            write_quoted(file, hint->value.s);
+        break;
+    case 'y':
+        fputs(" byte:", file);
+        write_quoted(file, hint->name);
+        fprintf(file, ":%u", hint->value.y);
+        break;
+    case 'b':
+        fputs(" boolean:", file);
+        write_quoted(file, hint->name);
+        fputs(hint->value.b ? ":true" : ":false", file);
+        break;
+    }
+}
+
+/*
+ * Writes data as one record line that batch_split_line() and the
+ * option parser turn back into the same notification. Relative file
+ * paths are written absolute.
+ */
+void batch_write_data(FILE *file, struct NotifyData *data)
+{
+    static const char *urgencies[] = { "low", "normal", "critical" };
+    unsigned char urgency = notif_get_urgency(data);
+    unsigned int i;
+
+    fprintf(file, "-r %u -t %i", notif_get_replaces_id(data), notif_get_expire_time(data));
+    if (urgency <= NOTIF_URGENCY_CRITICAL)
+        fprintf(file, " -u %s", urgencies[urgency]);
+
+    fputs(" -a", file);
+    write_argument(file, notif_get_app_name(data));
+    fputs(" -i ", file);
+    if (relative_path(notif_get_icon(data)))
+        write_path(file, notif_get_icon(data));
+    else
+        write_quoted(file, notif_get_icon(data));
+    fputs(" -c", file);
+    write_argument(file, notif_get_category(data));
+
+    if (notif_get_tag(data) != NULL) {
+        fputs(" -g", file);
+        write_argument(file, notif_get_tag(data));
+    }
+
+    for (i = 0; i < notif_get_hint_count(data); ++i)
+        write_hint(file, notif_get_hint(data, i));
+
+    if (notif_get_image_path(data) != NULL) {
+        fprintf(file, " -I %ix%i:", notif_get_image_width(data), notif_get_image_height(data));
+        write_path(file, notif_get_image_path(data));
+    }
+
+    for (i = 0; i < notif_get_action_count(data); ++i) {
+        fputs(" -A", file);
+        write_argument(file, notif_get_action_key(data, i));
+        fputc(':', file);
+        write_quoted(file, notif_get_action_label(data, i));
+    }
+
+    fputs(" --", file);
+    write_argument(file, notif_get_summary(data));
+    write_argument(file, notif_get_body(data));
+    fputc('\n', file);
+}
@@ -0,0 +1,54 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Batch records are lines of command line arguments, quoted the way
+ * a shell would quote them:
+ *
+ *   -u critical -i dialog-error "Disk full" "/home has 0 bytes left"
+ */
+
+#include "notif.h"
+
+#define BATCH_MAX_ARGS 64
+
+/*
+ * Line reader for modes that poll their input together with timers,
+ * where stdio buffering would hide lines from poll().
+ */
+struct BatchInput {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t start;
+    bool eof;
+};
+
+void batch_input_init(struct BatchInput *input, int fd);
+void batch_input_free(struct BatchInput *input);
+int batch_input_fill(struct BatchInput *input);
+char *batch_input_line(struct BatchInput *input);
+
+int batch_split_line(char *line, char **argv, int size);
+void batch_write_data(FILE *file, struct NotifyData *data);
+
+#endif /* BATCH_H */
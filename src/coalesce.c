@@ -0,0 +1,250 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Latest-wins coalescing of notification updates read from stdin.
+ *
+ * Updates are keyed by tag, or by replaces_id when there is no tag.
+ * For every key at most one notification is sent per interval, updates
+ * arriving in between replace the pending one so only the newest is
+ * sent. Pending updates are always sent before exiting.
+ */
+
+#include "coalesce.h"
+#include "batch.h"
+#include "options.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Slot {
+    char *tag;
+    unsigned int replaces_id;
+    int id;
+    long last_sent;
+    struct NotifyData *pending;
+};
+
+static struct Slot *_coalesce_slots = NULL;
+static size_t _coalesce_count = 0;
+static size_t _coalesce_size = 0;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int wait_ms(long due)
+{
+    long ms = due - now_ms();
+
+    return ms < 0 ? 0 : (int) ms;
+}
+
+static struct Slot *find_slot(struct NotifyData *data)
+{
+    struct Slot *slot, *slots;
+    const char *tag = notif_get_tag(data);
+    unsigned int replaces_id = notif_get_replaces_id(data);
+    size_t i;
+
+    /* without a key every record is a new notification */
+    if (tag == NULL && replaces_id == 0)
+        return NULL;
+
+    for (i = 0; i < _coalesce_count; ++i) {
+        slot = &_coalesce_slots[i];
+        if (tag != NULL ? slot->tag != NULL && strcmp(slot->tag, tag) == 0
+                        : slot->tag == NULL && slot->replaces_id == replaces_id)
+            return slot;
+    }
+
+    if (_coalesce_count == _coalesce_size) {
+        _coalesce_size = _coalesce_size ? _coalesce_size * 2 : 16;
+        slots = (struct Slot*) realloc(_coalesce_slots, _coalesce_size * sizeof(struct Slot));
+        if (slots == NULL)
+            return NULL;
+        _coalesce_slots = slots;
+    }
+
+    slot = &_coalesce_slots[_coalesce_count++];
+    slot->tag = tag != NULL ? strdup(tag) : NULL;
+    slot->replaces_id = replaces_id;
+    slot->id = 0;
+    slot->last_sent = 0;
+    slot->pending = NULL;
+    return slot;
+}
+
+/* Sends data and frees it, returns 1 on failure */
+static int send_update(struct Slot *slot, struct NotifyData *data, long now)
+{
+    int id, ret = 0;
+
+    /* later updates of a tag replace the notification shown for it */
+    if (slot != NULL && slot->id > 0 && notif_get_replaces_id(data) == 0)
+        notif_set_replaces_id(data, slot->id);
+
+    id = notif_send_notification(data);
+    if (id == -1) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        ret = 1;
+    }
+    else {
+        fprintf(notif_get_id_file(data), "%i\n", id);
+        fflush(notif_get_id_file(data));
+    }
+
+    if (slot != NULL) {
+        if (id > 0)
+            slot->id = id;
+        slot->last_sent = now;
+        slot->pending = NULL;
+    }
+
+    notif_free_data(data);
+    return ret;
+}
+
+/*
+ * Sends pending updates whose interval has passed. Returns time when
+ * the next pending update is due, or -1 when nothing is pending.
+ */
+static long send_due(int interval, int *ret)
+{
+    struct Slot *slot;
+    long now = now_ms(), next = -1, due;
+    size_t i;
+
+    for (i = 0; i < _coalesce_count; ++i) {
+        slot = &_coalesce_slots[i];
+        if (slot->pending == NULL)
+            continue;
+
+        due = slot->last_sent + interval;
+        if (due <= now) {
+            *ret |= send_update(slot, slot->pending, now);
+            continue;
+        }
+        if (next == -1 || due < next)
+            next = due;
+    }
+
+    return next;
+}
+
+static void handle_update(struct NotifyData *data, int interval, int *ret)
+{
+    struct Slot *slot = find_slot(data);
+    long now = now_ms();
+
+    if (slot == NULL) {
+        *ret |= send_update(NULL, data, now);
+        return;
+    }
+
+    if (slot->pending != NULL) {
+        notif_free_data(slot->pending);
+        slot->pending = data;
+        return;
+    }
+
+    if (slot->last_sent == 0 || now - slot->last_sent >= interval)
+        *ret |= send_update(slot, data, now);
+    else
+        slot->pending = data;
+}
+
+int coalesce_run(int interval)
+{
+    struct BatchInput input;
+    struct NotifyData *data;
+    struct pollfd pfd;
+    char *line;
+    long next;
+    int parsed, lineno = 0, ret = 0;
+    size_t i;
+
+    batch_input_init(&input, STDIN_FILENO);
+
+    for (;;) {
+        next = send_due(interval, &ret);
+
+        if (input.eof) {
+            if (next == -1)
+                break;
+            /* wait for the last updates to become due */
+            poll(NULL, 0, wait_ms(next));
+            continue;
+        }
+
+        pfd.fd = input.fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, next == -1 ? -1 : wait_ms(next)) <= 0)
+            continue;
+
+        /* a read error ends the input, pending updates are still sent */
+        if (batch_input_fill(&input) < 0) {
+            perror("Could not read input");
+            input.eof = true;
+            ret = 1;
+            continue;
+        }
+
+        while ((line = batch_input_line(&input)) != NULL) {
+            ++lineno;
+
+            data = notif_create_data();
+            if (data == NULL) {
+                fprintf(errout, "Line %i: Out Of Memory!\n", lineno);
+                ret = 1;
+                continue;
+            }
+            parsed = parse_record(line, data);
+
+            if (parsed == PARSE_OK) {
+                handle_update(data, interval, &ret);
+                continue;
+            }
+
+            if (parsed != PARSE_EMPTY) {
+                fprintf(errout, "Line %i: invalid record\n", lineno);
+                ret = 1;
+            }
+            notif_free_data(data);
+        }
+    }
+
+    for (i = 0; i < _coalesce_count; ++i) {
+        notif_free_data(_coalesce_slots[i].pending);
+        free(_coalesce_slots[i].tag);
+    }
+    free(_coalesce_slots);
+    batch_input_free(&input);
+
+    return ret;
+}
@@ -0,0 +1,412 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * notify-desktop --daemon keeps one session bus connection open and
+ * serves requests on $XDG_RUNTIME_DIR/notify-desktop/socket.
+ *
+ * Requests are batch records (see batch.h), one per line. Replies are
+ * one line with the notification ID, or "error" followed by the
+ * NOTIF_ERROR_* kind and the message.
+ * Clients only connect, write and read, they never touch D-Bus.
+ */
+
+#include "daemon.h"
+#include "batch.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_REPLY 512
+
+struct Client {
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+static volatile sig_atomic_t _daemon_quit = 0;
+
+static bool socket_path(struct sockaddr_un *addr)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int len;
+
+    if (runtime == NULL || runtime[0] == '\0')
+        return false;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+                   "%s/notify-desktop/socket", runtime);
+
+    return len > 0 && (size_t) len < sizeof(addr->sun_path);
+}
+
+static int connect_daemon(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!socket_path(&addr))
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int wait_ms(long due)
+{
+    long ms = due - now_ms();
+
+    return ms < 0 ? 0 : (int) ms;
+}
+
+static double trace_begin(struct NotifyTrace *trace)
+{
+    struct timespec ts;
+
+    if (NULL == trace)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void trace_end(struct NotifyTrace *trace, int phase, double start)
+{
+    if (NULL == trace)
+        return;
+
+    trace->phase[phase] += trace_begin(trace) - start;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = send(fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*
+ * Sends data through a running daemon. Returns -1 when no daemon is
+ * running, so the caller can send directly, 0 on success and the
+ * NOTIF_ERROR_* kind of the failure with its message in error.
+ *
+ * With trace set, connecting to the daemon, serializing the record,
+ * writing it and waiting for the reply are timed as the send phases.
+ */
+int daemon_send(struct NotifyData *data, bool no_wait, int timeout, int *id,
+                struct NotifyTrace *trace, char *error, size_t size)
+{
+    struct pollfd pfd;
+    char reply[DAEMON_MAX_REPLY];
+    char *line = NULL, *end;
+    size_t line_size = 0, len = 0;
+    long kind;
+    ssize_t ret;
+    FILE *file;
+    double start;
+    bool ok;
+    int fd;
+
+    start = trace_begin(trace);
+    fd = connect_daemon();
+    trace_end(trace, NOTIF_TRACE_CONNECT, start);
+    if (fd == -1)
+        return -1;
+
+    start = trace_begin(trace);
+    file = open_memstream(&line, &line_size);
+    if (file == NULL) {
+        close(fd);
+        return -1;
+    }
+    batch_write_data(file, data);
+    fclose(file);
+    trace_end(trace, NOTIF_TRACE_MARSHAL, start);
+
+    start = trace_begin(trace);
+    ok = write_all(fd, line, line_size);
+    trace_end(trace, NOTIF_TRACE_FLUSH, start);
+    free(line);
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+
+    if (no_wait) {
+        close(fd);
+        if (trace != NULL)
+            ++trace->count;
+        *id = 0;
+        return 0;
+    }
+
+    start = trace_begin(trace);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (len == 0 || reply[len - 1] != '\n') {
+        ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0) {
+            snprintf(error, size, "Timeout waiting for notify-desktop daemon");
+            close(fd);
+            return NOTIF_ERROR_TIMEOUT;
+        }
+
+        ret = read(fd, reply + len, sizeof(reply) - 1 - len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0 || len + ret == sizeof(reply) - 1) {
+            snprintf(error, size, "Invalid reply from notify-desktop daemon");
+            close(fd);
+            return NOTIF_ERROR_OTHER;
+        }
+        len += ret;
+    }
+    close(fd);
+    trace_end(trace, NOTIF_TRACE_REPLY, start);
+
+    if (trace != NULL)
+        ++trace->count;
+
+    reply[len - 1] = '\0';
+    /* errors of the daemon's own calls keep their kind */
+    if (strncmp(reply, "error ", 6) == 0) {
+        kind = strtol(reply + 6, &end, 10);
+        if (end == reply + 6 || *end != ' ' ||
+            kind < NOTIF_ERROR_OTHER || kind > NOTIF_ERROR_NO_BUS)
+            kind = NOTIF_ERROR_OTHER;
+        else
+            ++end;
+        snprintf(error, size, "%s", end);
+        return kind;
+    }
+
+    *id = atoi(reply);
+    return 0;
+}
+
+static int listen_daemon(void)
+{
+    struct sockaddr_un addr;
+    char *slash;
+    int fd;
+
+    if (!socket_path(&addr)) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+        return -1;
+    }
+
+    fd = connect_daemon();
+    if (fd != -1) {
+        close(fd);
+        fprintf(stderr, "notify-desktop daemon is already running\n");
+        return -1;
+    }
+
+    slash = strrchr(addr.sun_path, '/');
+    *slash = '\0';
+    if (mkdir(addr.sun_path, 0700) < 0 && errno != EEXIST) {
+        perror("Could not create runtime directory");
+        return -1;
+    }
+    *slash = '/';
+
+    /* socket left behind by a daemon that was killed */
+    unlink(addr.sun_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        perror("Could not create daemon socket");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void quit_handler(int signum)
+{
+    (void) signum;
+    _daemon_quit = 1;
+}
+
+static void close_client(struct Client *client)
+{
+    close(client->fd);
+    free(client->buf);
+    client->fd = -1;
+    client->buf = NULL;
+    client->len = 0;
+}
+
+/* Reads from client and handles all complete lines */
+static void read_client(struct Client *client, DaemonHandler handler)
+{
+    char reply[DAEMON_MAX_REPLY];
+    char *line, *end;
+    ssize_t ret;
+    size_t len;
+
+    ret = read(client->fd, client->buf + client->len, DAEMON_MAX_REQUEST - client->len);
+    if (ret < 0 && errno == EINTR)
+        return;
+    if (ret <= 0) {
+        close_client(client);
+        return;
+    }
+    client->len += ret;
+
+    line = client->buf;
+    while ((end = memchr(line, '\n', client->len - (line - client->buf))) != NULL) {
+        *end = '\0';
+        handler(line, reply, sizeof(reply) - 1);
+        len = strlen(reply);
+        reply[len++] = '\n';
+        /* client may have gone away already, e.g. with --no-wait */
+        write_all(client->fd, reply, len);
+        line = end + 1;
+    }
+
+    len = client->len - (line - client->buf);
+    if (len == DAEMON_MAX_REQUEST) {
+        write_all(client->fd, "error 1 Request too long\n", 25);
+        close_client(client);
+        return;
+    }
+    memmove(client->buf, line, len);
+    client->len = len;
+}
+
+int daemon_run(DaemonHandler handler, DaemonTick tick, int interval)
+{
+    struct Client clients[DAEMON_MAX_CLIENTS];
+    struct pollfd pfds[DAEMON_MAX_CLIENTS + 1];
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    int listen_fd, fd, i, n;
+    long due = now_ms() + interval;
+
+    listen_fd = listen_daemon();
+    if (listen_fd == -1)
+        return 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = quit_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (i = 0; i < DAEMON_MAX_CLIENTS; ++i) {
+        clients[i].fd = -1;
+        clients[i].buf = NULL;
+        clients[i].len = 0;
+    }
+
+    while (!_daemon_quit) {
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < DAEMON_MAX_CLIENTS; ++i) {
+            pfds[i + 1].fd = clients[i].fd;
+            pfds[i + 1].events = POLLIN;
+        }
+
+        n = poll(pfds, DAEMON_MAX_CLIENTS + 1, tick != NULL ? wait_ms(due) : -1);
+        if (tick != NULL && wait_ms(due) == 0) {
+            tick();
+            due = now_ms() + interval;
+        }
+        if (n <= 0)
+            continue;
+
+        for (i = 0; i < DAEMON_MAX_CLIENTS; ++i) {
+            if (clients[i].fd != -1 && pfds[i + 1].revents != 0)
+                read_client(&clients[i], handler);
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0)
+                continue;
+
+            for (i = 0; i < DAEMON_MAX_CLIENTS && clients[i].fd != -1; ++i)
+                ;
+            if (i == DAEMON_MAX_CLIENTS ||
+                (clients[i].buf = (char*) malloc(DAEMON_MAX_REQUEST)) == NULL) {
+                close(fd);
+                continue;
+            }
+            clients[i].fd = fd;
+            clients[i].len = 0;
+        }
+    }
+
+    for (i = 0; i < DAEMON_MAX_CLIENTS; ++i) {
+        if (clients[i].fd != -1)
+            close_client(&clients[i]);
+    }
+    close(listen_fd);
+
+    if (tick != NULL)
+        tick();
+
+    if (socket_path(&addr))
+        unlink(addr.sun_path);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "notif.h"
+
+#include <stddef.h>
+
+#define DAEMON_MAX_REQUEST 65536
+
+/*
+ * Handles one request line and writes the reply line (without newline)
+ * into reply.
+ */
+typedef void (*DaemonHandler)(char *request, char *reply, size_t size);
+
+/* Called every interval ms while serving requests */
+typedef void (*DaemonTick)(void);
+
+int daemon_run(DaemonHandler handler, DaemonTick tick, int interval);
+int daemon_send(struct NotifyData *data, bool no_wait, int timeout, int *id,
+                struct NotifyTrace *trace, char *error, size_t size);
+
+#endif /* DAEMON_H */
@@ -18,75 +18,321 @@
 
 #define DBUS_API_SUBJECT_TO_CHANGE
 #include "dbusimp.h"
+#include "image.h"
 
 #include <dbus/dbus.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static char *_notif_error = NULL;
+struct PendingNotification {
+    DBusPendingCall *pending;
+    double sent;
+    struct NotifyData *data;
+    NotifyCallback callback;
+    void *user_data;
+};
+
+struct NotifyContext {
+    char *error;
+    int error_kind;
+    DBusConnection *conn;
+    bool private_conn;
+    int timeout;
+    struct NotifyTrace *trace;
+    struct NotifyMetrics *metrics;
+    bool connected;
+    char *event_key;
+    struct ImageCache images;
+    struct ServerCache server;
 
-static void create_error_message(char *mes)
+    struct PendingNotification *queue;
+    unsigned int window;
+    unsigned int queue_head;
+    unsigned int queue_count;
+};
+
+static void create_error_message(struct NotifyContext *ctx, int kind, const char *mes)
 {
     size_t size = strlen(mes) + 1;
 
-    _notif_error = (char*) malloc(size);
-    strncpy(_notif_error, mes, size);
+    ctx->error_kind = kind;
+
+    free(ctx->error);
+    ctx->error = (char*) malloc(size);
+    strncpy(ctx->error, mes, size);
 }
 
-int _notif_send_notification(struct NotifyData *data)
+static double now_ms(void)
 {
-    /*
-     * DBus code based on tutorial from http://www.matthew.ath.cx/misc/dbus
-     * Thanks!
-     */
+    struct timespec ts;
 
-    DBusMessage *msg;
-    DBusMessageIter args, actions, hints, hint_1, hint_2, variant_1, variant_2;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double trace_begin(struct NotifyContext *ctx)
+{
+    if (NULL == ctx->trace && NULL == ctx->metrics)
+        return 0;
+
+    return now_ms();
+}
+
+static void trace_end(struct NotifyContext *ctx, int phase, double start)
+{
+    double ms;
+
+    if (NULL == ctx->trace && NULL == ctx->metrics)
+        return;
+
+    ms = now_ms() - start;
+    if (ctx->trace != NULL)
+        ctx->trace->phase[phase] += ms;
+    if (ctx->metrics != NULL && phase == NOTIF_TRACE_MARSHAL)
+        _notif_metrics_observe(ctx->metrics, &ctx->metrics->marshal, ms);
+}
+
+static void observe_round_trip(struct NotifyContext *ctx, double sent)
+{
+    if (ctx->metrics != NULL)
+        _notif_metrics_observe(ctx->metrics, &ctx->metrics->round_trip, now_ms() - sent);
+}
+
+/*
+ * Connection is created on first send and reused by all following
+ * sends, so sending many notifications costs only one handshake.
+ *
+ * Only the handshakes Notify needs are done: authentication and
+ * Hello, which dbus_bus_get() performs. No well-known name is
+ * requested, replies are routed to our unique name.
+ */
+static DBusConnection *get_connection(struct NotifyContext *ctx)
+{
     DBusConnection *conn;
     DBusError err;
-    DBusPendingCall *pending;
-    int ret, sent_id;
     char errorbuf[255];
-    const char *tmp_string;
-    unsigned int replaces_id;
-    unsigned char urgency;
-    int expire_time;
+    double start;
 
-    sent_id = -1;
+    if (ctx->conn != NULL && dbus_connection_get_is_connected(ctx->conn))
+        return ctx->conn;
+
+    /* the bus went away, connect again */
+    if (ctx->conn != NULL)
+        _notif_close_connection(ctx);
 
     /* initialise the errors */
     dbus_error_init(&err);
+    start = trace_begin(ctx);
+
+    /* connect to the session bus and check for errors */
+    if (ctx->private_conn)
+        conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+    else
+        conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
 
-    /* connect to the system bus and check for errors */
-    conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
     if (dbus_error_is_set(&err)) {
-        sprintf(errorbuf, "Connection Error (%s)\n", err.message);
+        snprintf(errorbuf, sizeof(errorbuf), "Connection Error (%s)", err.message);
         dbus_error_free(&err);
-        create_error_message(errorbuf);
-        return sent_id;
+        create_error_message(ctx, NOTIF_ERROR_NO_BUS, errorbuf);
+        return NULL;
     }
     if (NULL == conn) {
-        create_error_message("Cannot create connection");
-        return sent_id;
+        create_error_message(ctx, NOTIF_ERROR_NO_BUS, "Cannot create connection");
+        return NULL;
     }
 
-    /* request our name on the bus */
-    ret = dbus_bus_request_name(conn,
-                                "test.method.caller",
-                                DBUS_NAME_FLAG_REPLACE_EXISTING,
-                                &err);
+    /* losing the bus is an error to report, not a reason to exit */
+    dbus_connection_set_exit_on_disconnect(conn, FALSE);
 
-    if (dbus_error_is_set(&err)) {
-        sprintf(errorbuf, "Name Error (%s)\n", err.message);
-        dbus_error_free(&err);
-        create_error_message(errorbuf);
-        return sent_id;
+    _notif_metrics_connected(ctx->metrics, trace_begin(ctx) - start, ctx->connected);
+    ctx->connected = true;
+
+    ctx->conn = conn;
+    return conn;
+}
+
+void _notif_set_private_connection(struct NotifyContext *ctx, bool private_conn)
+{
+    ctx->private_conn = private_conn;
+}
+
+void _notif_close_connection(struct NotifyContext *ctx)
+{
+    if (ctx->conn == NULL)
+        return;
+
+    _notif_flush_queue(ctx);
+
+    /* shared connections are owned by libdbus and must not be closed */
+    if (ctx->private_conn)
+        dbus_connection_close(ctx->conn);
+    dbus_connection_unref(ctx->conn);
+    ctx->conn = NULL;
+}
+
+/*
+ * Contexts use private connections by default, so contexts used from
+ * different threads never share a connection.
+ */
+struct NotifyContext *_notif_create_context(void)
+{
+    struct NotifyContext *ctx;
+
+    if (!dbus_threads_init_default())
+        return NULL;
+
+    ctx = (struct NotifyContext*) calloc(1, sizeof(struct NotifyContext));
+    if (NULL == ctx)
+        return NULL;
+
+    ctx->private_conn = true;
+    ctx->timeout = DBUS_TIMEOUT_USE_DEFAULT;
+    ctx->window = NOTIF_DEFAULT_WINDOW;
+    return ctx;
+}
+
+void _notif_free_context(struct NotifyContext *ctx)
+{
+    _notif_close_connection(ctx);
+    free(ctx->queue);
+    free(ctx->event_key);
+    image_cache_free(&ctx->images);
+    free(ctx->error);
+    free(ctx);
+}
+
+static int get_reply_id(struct NotifyContext *ctx, DBusMessage *reply)
+{
+    DBusMessageIter args;
+    const char *message = NULL;
+    char errorbuf[255];
+    dbus_uint32_t id;
+
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        dbus_message_get_args(reply, NULL,
+                              DBUS_TYPE_STRING, &message,
+                              DBUS_TYPE_INVALID);
+        snprintf(errorbuf, sizeof(errorbuf), "%s (%s)",
+                 dbus_message_get_error_name(reply),
+                 message != NULL ? message : "no message");
+        create_error_message(ctx, _notif_error_name_kind(dbus_message_get_error_name(reply)),
+                             errorbuf);
+        return -1;
     }
-    if (DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != ret) {
-        create_error_message("Cannot get name on the bus");
-        return sent_id;
+
+    if (!dbus_message_iter_init(reply, &args) ||
+        dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_UINT32) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Invalid reply signature");
+        return -1;
+    }
+
+    dbus_message_iter_get_basic(&args, &id);
+    _notif_server_seen(&ctx->server, dbus_message_get_sender(reply));
+    return (int) id;
+}
+
+/* Body as the server can show it, without markup if it has none */
+static bool append_body(DBusMessageIter *args, const char *body, unsigned int capabilities)
+{
+    char *plain;
+    bool ok;
+
+    if (!(capabilities & NOTIF_CAP_BODY))
+        body = "";
+
+    if (!(capabilities & NOTIF_CAP_BODY_MARKUP) && strpbrk(body, "<&") != NULL) {
+        plain = (char*) malloc(strlen(body) + 1);
+        if (NULL == plain)
+            return false;
+        _notif_strip_markup(plain, body);
+        ok = dbus_message_iter_append_basic(args, DBUS_TYPE_STRING, &plain);
+        free(plain);
+        return ok;
+    }
+
+    return dbus_message_iter_append_basic(args, DBUS_TYPE_STRING, &body);
+}
+
+static bool append_hint(DBusMessageIter *hints, const struct NotifyHint *hint)
+{
+    DBusMessageIter entry, variant;
+    char signature[2] = { hint->type, '\0' };
+    dbus_bool_t boolean = hint->value.b;
+    const void *value = &hint->value;
+
+    /* dbus_bool_t is wider than bool */
+    if (hint->type == DBUS_TYPE_BOOLEAN)
+        value = &boolean;
+
+    return dbus_message_iter_open_container(hints, DBUS_TYPE_DICT_ENTRY, NULL, &entry) &&
+           dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &hint->name) &&
+           dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant) &&
+           dbus_message_iter_append_basic(&variant, hint->type, value) &&
+           dbus_message_iter_close_container(&entry, &variant) &&
+           dbus_message_iter_close_container(hints, &entry);
+}
+
+/*
+ * image-data hint (iiibiiay): width, height, rowstride, has_alpha,
+ * bits_per_sample, channels and the pixels, appended from the cached copy
+ */
+static bool append_image(DBusMessageIter *hints, const struct NotifyImage *image)
+{
+    DBusMessageIter entry, variant, fields, pixels;
+    const char *name = "image-data";
+    const unsigned char *data = image->pixels;
+    dbus_bool_t has_alpha = image->channels == 4;
+    int bits_per_sample = 8;
+
+    return dbus_message_iter_open_container(hints, DBUS_TYPE_DICT_ENTRY, NULL, &entry) &&
+           dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name) &&
+           dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "(iiibiiay)", &variant) &&
+           dbus_message_iter_open_container(&variant, DBUS_TYPE_STRUCT, NULL, &fields) &&
+           dbus_message_iter_append_basic(&fields, DBUS_TYPE_INT32, &image->width) &&
+           dbus_message_iter_append_basic(&fields, DBUS_TYPE_INT32, &image->height) &&
+           dbus_message_iter_append_basic(&fields, DBUS_TYPE_INT32, &image->rowstride) &&
+           dbus_message_iter_append_basic(&fields, DBUS_TYPE_BOOLEAN, &has_alpha) &&
+           dbus_message_iter_append_basic(&fields, DBUS_TYPE_INT32, &bits_per_sample) &&
+           dbus_message_iter_append_basic(&fields, DBUS_TYPE_INT32, &image->channels) &&
+           dbus_message_iter_open_container(&fields, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &pixels) &&
+           dbus_message_iter_append_fixed_array(&pixels, DBUS_TYPE_BYTE, &data, (int) image->size) &&
+           dbus_message_iter_close_container(&fields, &pixels) &&
+           dbus_message_iter_close_container(&variant, &fields) &&
+           dbus_message_iter_close_container(&entry, &variant) &&
+           dbus_message_iter_close_container(hints, &entry);
+}
+
+static DBusMessage *create_message(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    /*
+     * DBus code based on tutorial from http://www.matthew.ath.cx/misc/dbus
+     * Thanks!
+     */
+
+    DBusMessage *msg;
+    DBusMessageIter args, actions, hints, hint_1, hint_2, variant_1, variant_2;
+    const struct NotifyImage *image;
+    const struct NotifyHint *hint;
+    const char *tmp_string;
+    char errorbuf[255];
+    unsigned int replaces_id, i, capabilities;
+    unsigned char urgency;
+    int expire_time;
+
+    if (_notif_data_out_of_memory(data)) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return NULL;
+    }
+
+    /* libdbus aborts on invalid strings */
+    tmp_string = _notif_invalid_string(data, true);
+    if (tmp_string != NULL) {
+        snprintf(errorbuf, sizeof(errorbuf), "Invalid UTF-8 in %s", tmp_string);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, errorbuf);
+        return NULL;
     }
 
     msg = dbus_message_new_method_call("org.freedesktop.Notifications",
@@ -94,9 +340,8 @@ int _notif_send_notification(struct NotifyData *data)
                                        "org.freedesktop.Notifications",
                                        "Notify");
     if (NULL == msg) {
-        sprintf(errorbuf, "Message Null\n");
-        create_error_message(errorbuf);
-        return sent_id;
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Message Null");
+        return NULL;
     }
 
     /* append arguments */
@@ -123,16 +368,24 @@ int _notif_send_notification(struct NotifyData *data)
         goto oom;
 
     /* body STRING */
-    tmp_string = notif_get_body(data);
-    if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &tmp_string))
+    capabilities = _notif_server_capabilities(&ctx->server);
+    if (!append_body(&args, notif_get_body(data), capabilities))
         goto oom;
 
-    /* actions ARRAY - appending empty array */
+    /* actions ARRAY - key and label of each action */
     if (!dbus_message_iter_open_container(&args,
                                           DBUS_TYPE_ARRAY,
                                           DBUS_TYPE_STRING_AS_STRING,
                                           &actions))
         goto oom;
+    for (i = 0; i < notif_get_action_count(data) && (capabilities & NOTIF_CAP_ACTIONS); ++i) {
+        tmp_string = notif_get_action_key(data, i);
+        if (!dbus_message_iter_append_basic(&actions, DBUS_TYPE_STRING, &tmp_string))
+            goto oom;
+        tmp_string = notif_get_action_label(data, i);
+        if (!dbus_message_iter_append_basic(&actions, DBUS_TYPE_STRING, &tmp_string))
+            goto oom;
+    }
     if (!dbus_message_iter_close_container(&args, &actions))
         goto oom;
 
@@ -205,6 +458,25 @@ int _notif_send_notification(struct NotifyData *data)
         goto oom;
     /* hint_2 end */
 
+    for (i = 0; i < notif_get_hint_count(data); ++i) {
+        hint = notif_get_hint(data, i);
+        if (_notif_hint_supported(capabilities, hint->name) && !append_hint(&hints, hint))
+            goto oom;
+    }
+
+    if (notif_get_image_path(data) != NULL) {
+        image = image_cache_get(&ctx->images, notif_get_image_path(data),
+                                notif_get_image_width(data), notif_get_image_height(data),
+                                errorbuf, sizeof(errorbuf));
+        if (NULL == image) {
+            dbus_message_unref(msg);
+            create_error_message(ctx, NOTIF_ERROR_OTHER, errorbuf);
+            return NULL;
+        }
+        if (!append_image(&hints, image))
+            goto oom;
+    }
+
     if (!dbus_message_iter_close_container(&args, &hints))
         goto oom;
     /* hints end */
@@ -214,56 +486,671 @@ int _notif_send_notification(struct NotifyData *data)
     if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_INT32, &expire_time))
         goto oom;
 
-    /* send message and get a handle for a reply (-1 default timeout) */
-    if (!dbus_connection_send_with_reply (conn, msg, &pending, -1))
-        goto oom;
+    return msg;
 
-    if (NULL == pending) {
-        sprintf(errorbuf, "Pending Call Null\n");
-        create_error_message(errorbuf);
+oom:
+    dbus_message_unref(msg);
+    create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+    return NULL;
+}
+
+int _notif_build_message(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    DBusMessage *msg = create_message(ctx, data);
+
+    if (NULL == msg)
+        return -1;
+
+    dbus_message_unref(msg);
+    return 0;
+}
+
+static int send_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    DBusMessage *msg;
+    DBusConnection *conn;
+    DBusPendingCall *pending;
+    double start, sent;
+    int sent_id;
+
+    sent_id = -1;
+
+    start = trace_begin(ctx);
+    conn = get_connection(ctx);
+    trace_end(ctx, NOTIF_TRACE_CONNECT, start);
+    if (NULL == conn)
+        return sent_id;
+
+    start = trace_begin(ctx);
+    msg = create_message(ctx, data);
+    trace_end(ctx, NOTIF_TRACE_MARSHAL, start);
+    if (NULL == msg)
+        return sent_id;
+
+    /* send message and get a handle for a reply */
+    start = sent = trace_begin(ctx);
+    if (!dbus_connection_send_with_reply(conn, msg, &pending, ctx->timeout)) {
+        dbus_message_unref(msg);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
         return sent_id;
     }
-    dbus_connection_flush(conn);
 
     /* free message */
     dbus_message_unref(msg);
 
+    if (NULL == pending) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Pending Call Null");
+        return sent_id;
+    }
+
+    /* blocking would flush too, flushing first separates the phases */
+    if (ctx->trace != NULL)
+        dbus_connection_flush(conn);
+    trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+
     /* block until we receive a reply */
+    start = trace_begin(ctx);
     dbus_pending_call_block(pending);
 
     /* get the reply message */
     msg = dbus_pending_call_steal_reply(pending);
+
+    /* free the pending message handle */
+    dbus_pending_call_unref(pending);
+
     if (NULL == msg) {
-        sprintf(errorbuf, "Reply Null\n");
-        create_error_message(errorbuf);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Reply Null");
         return sent_id;
     }
 
-    /* free the pending message handle */
-    dbus_pending_call_unref(pending);
+    observe_round_trip(ctx, sent);
+    sent_id = get_reply_id(ctx, msg);
+    trace_end(ctx, NOTIF_TRACE_REPLY, start);
 
-    if (dbus_message_iter_init(msg, &args) &&
-        dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_UINT32)
-        dbus_message_iter_get_basic(&args, &sent_id);
+    if (ctx->trace != NULL)
+        ++ctx->trace->count;
 
-    /* free reply and close connection */
+    /* free reply */
     dbus_message_unref(msg);
 
     return sent_id;
+}
 
-oom:
-    sprintf(errorbuf, "Out Of Memory!\n");
-    create_error_message(errorbuf);
-    return sent_id;
+int _notif_send_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    int id = send_notification(ctx, data);
+
+    _notif_metrics_result(ctx->metrics, id, ctx->error_kind);
+    return id;
+}
+
+/*
+ * Sends notification without asking for a reply. Only errors up to
+ * writing the message are detected: missing bus, failed connection
+ * and marshalling. Missing notification server and errors returned
+ * by the server are not reported, the bus drops them for no-reply
+ * messages.
+ */
+static int post_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    DBusMessage *msg;
+    DBusConnection *conn;
+    dbus_bool_t ret;
+    double start;
+
+    start = trace_begin(ctx);
+    conn = get_connection(ctx);
+    trace_end(ctx, NOTIF_TRACE_CONNECT, start);
+    if (NULL == conn)
+        return -1;
+
+    start = trace_begin(ctx);
+    msg = create_message(ctx, data);
+    trace_end(ctx, NOTIF_TRACE_MARSHAL, start);
+    if (NULL == msg)
+        return -1;
+
+    start = trace_begin(ctx);
+    dbus_message_set_no_reply(msg, TRUE);
+    ret = dbus_connection_send(conn, msg, NULL);
+    dbus_message_unref(msg);
+
+    if (!ret) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return -1;
+    }
+
+    /* otherwise the write happens on close, outside of any phase */
+    if (ctx->trace != NULL) {
+        dbus_connection_flush(conn);
+        ++ctx->trace->count;
+    }
+    trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+
+    return 0;
+}
+
+int _notif_post_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    int ret = post_notification(ctx, data);
+
+    _notif_metrics_posted(ctx->metrics, ret, ctx->error_kind);
+    return ret;
+}
+
+/*
+ * Errors of the notification server mean the notification is already
+ * gone, only errors from the bus itself (no server, no reply) count.
+ */
+static bool close_failed(struct NotifyContext *ctx, DBusMessage *reply)
+{
+    const char *name;
+    char errorbuf[255];
+
+    if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_ERROR)
+        return false;
+
+    name = dbus_message_get_error_name(reply);
+    if (name == NULL || strncmp(name, "org.freedesktop.DBus.Error.", 27) != 0)
+        return false;
+
+    snprintf(errorbuf, sizeof(errorbuf), "%s", name);
+    create_error_message(ctx, _notif_error_name_kind(name), errorbuf);
+    return true;
+}
+
+int _notif_close_notifications(struct NotifyContext *ctx, const unsigned int *ids, unsigned int count)
+{
+    DBusConnection *conn;
+    DBusPendingCall **pending;
+    DBusMessage *msg;
+    dbus_uint32_t id;
+    unsigned int i, sent;
+    int ret = 0;
+
+    if (count == 0)
+        return 0;
+
+    conn = get_connection(ctx);
+    if (NULL == conn)
+        return -1;
+
+    pending = (DBusPendingCall**) calloc(count, sizeof(DBusPendingCall*));
+    if (NULL == pending) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return -1;
+    }
+
+    for (sent = 0; sent < count; ++sent) {
+        msg = dbus_message_new_method_call("org.freedesktop.Notifications",
+                                           "/org/freedesktop/Notifications",
+                                           "org.freedesktop.Notifications",
+                                           "CloseNotification");
+        id = ids[sent];
+        if (NULL == msg ||
+            !dbus_message_append_args(msg, DBUS_TYPE_UINT32, &id, DBUS_TYPE_INVALID) ||
+            !dbus_connection_send_with_reply(conn, msg, &pending[sent], ctx->timeout) ||
+            NULL == pending[sent]) {
+            if (msg != NULL)
+                dbus_message_unref(msg);
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+            ret = -1;
+            break;
+        }
+        dbus_message_unref(msg);
+    }
+
+    /* replies of the sent calls are collected even after an error */
+    dbus_connection_flush(conn);
+    for (i = 0; i < sent; ++i) {
+        dbus_pending_call_block(pending[i]);
+        msg = dbus_pending_call_steal_reply(pending[i]);
+        dbus_pending_call_unref(pending[i]);
+
+        if (NULL == msg) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Reply Null");
+            ret = -1;
+            continue;
+        }
+        if (close_failed(ctx, msg))
+            ret = -1;
+        dbus_message_unref(msg);
+    }
+
+    free(pending);
+    return ret;
+}
+
+/*
+ * Queued notifications are kept in a ring in the order they were sent,
+ * so completions are reported in input order even when replies arrive
+ * out of order.
+ */
+static bool complete_queue_head(struct NotifyContext *ctx, bool block)
+{
+    struct PendingNotification *head;
+    DBusMessage *reply;
+    double start;
+    int id;
+
+    if (ctx->queue_count == 0)
+        return false;
+
+    head = &ctx->queue[ctx->queue_head];
+
+    if (!dbus_pending_call_get_completed(head->pending)) {
+        if (!block)
+            return false;
+        start = trace_begin(ctx);
+        dbus_pending_call_block(head->pending);
+        trace_end(ctx, NOTIF_TRACE_REPLY, start);
+    }
+
+    reply = dbus_pending_call_steal_reply(head->pending);
+    dbus_pending_call_unref(head->pending);
+
+    ctx->queue_head = (ctx->queue_head + 1) % ctx->window;
+    --ctx->queue_count;
+
+    if (NULL == reply) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Reply Null");
+        id = -1;
+    }
+    else {
+        observe_round_trip(ctx, head->sent);
+        id = get_reply_id(ctx, reply);
+        dbus_message_unref(reply);
+    }
+
+    _notif_metrics_result(ctx->metrics, id, ctx->error_kind);
+    head->callback(head->data, id, head->user_data);
+    return true;
+}
+
+void _notif_set_window_size(struct NotifyContext *ctx, unsigned int size)
+{
+    if (size == 0)
+        size = 1;
+
+    /* window can only be resized while nothing is in flight */
+    _notif_flush_queue(ctx);
+
+    free(ctx->queue);
+    ctx->queue = NULL;
+    ctx->queue_head = 0;
+    ctx->window = size;
+}
+
+void _notif_set_reply_timeout(struct NotifyContext *ctx, int timeout)
+{
+    ctx->timeout = timeout;
+}
+
+static int queue_notification(struct NotifyContext *ctx, struct NotifyData *data,
+                              NotifyCallback callback, void *user_data)
+{
+    struct PendingNotification *item;
+    DBusMessage *msg;
+    DBusConnection *conn;
+    DBusPendingCall *pending;
+    double start;
+
+    start = trace_begin(ctx);
+    conn = get_connection(ctx);
+    trace_end(ctx, NOTIF_TRACE_CONNECT, start);
+    if (NULL == conn)
+        return -1;
+
+    if (NULL == ctx->queue) {
+        ctx->queue = (struct PendingNotification*) malloc(ctx->window * sizeof(struct PendingNotification));
+        if (NULL == ctx->queue) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+            return -1;
+        }
+    }
+
+    /* wait for the oldest call when the window is full */
+    if (ctx->queue_count == ctx->window)
+        complete_queue_head(ctx, true);
+
+    start = trace_begin(ctx);
+    msg = create_message(ctx, data);
+    trace_end(ctx, NOTIF_TRACE_MARSHAL, start);
+    if (NULL == msg)
+        return -1;
+
+    start = trace_begin(ctx);
+    if (!dbus_connection_send_with_reply(conn, msg, &pending, ctx->timeout)) {
+        dbus_message_unref(msg);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return -1;
+    }
+    dbus_message_unref(msg);
+
+    if (NULL == pending) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Pending Call Null");
+        return -1;
+    }
+
+    item = &ctx->queue[(ctx->queue_head + ctx->queue_count) % ctx->window];
+    item->pending = pending;
+    item->sent = start;
+    item->data = data;
+    item->callback = callback;
+    item->user_data = user_data;
+    ++ctx->queue_count;
+
+    if (ctx->trace != NULL)
+        ++ctx->trace->count;
+
+    /* write what we can and collect replies that already arrived */
+    dbus_connection_read_write(conn, 0);
+    trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+    while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    while (complete_queue_head(ctx, false))
+        ;
+
+    return 0;
+}
+
+int _notif_queue_notification(struct NotifyContext *ctx, struct NotifyData *data,
+                              NotifyCallback callback, void *user_data)
+{
+    int ret = queue_notification(ctx, data, callback, user_data);
+
+    if (ret != 0)
+        _notif_metrics_result(ctx->metrics, -1, ctx->error_kind);
+    return ret;
+}
+
+void _notif_flush_queue(struct NotifyContext *ctx)
+{
+    double start;
+
+    if (ctx->conn != NULL) {
+        start = trace_begin(ctx);
+        dbus_connection_flush(ctx->conn);
+        trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+    }
+
+    while (complete_queue_head(ctx, true))
+        ;
+}
+
+static DBusPendingCall *call_server(struct NotifyContext *ctx, DBusConnection *conn, const char *method)
+{
+    DBusPendingCall *pending = NULL;
+    DBusMessage *msg;
+
+    msg = dbus_message_new_method_call("org.freedesktop.Notifications",
+                                       "/org/freedesktop/Notifications",
+                                       "org.freedesktop.Notifications",
+                                       method);
+    if (NULL == msg || !dbus_connection_send_with_reply(conn, msg, &pending, ctx->timeout))
+        pending = NULL;
+    if (msg != NULL)
+        dbus_message_unref(msg);
+    return pending;
+}
+
+static DBusMessage *server_reply(struct NotifyContext *ctx, DBusPendingCall *pending)
+{
+    DBusMessage *reply;
+    char errorbuf[255];
+    const char *message = NULL;
+
+    dbus_pending_call_block(pending);
+    reply = dbus_pending_call_steal_reply(pending);
+    dbus_pending_call_unref(pending);
+
+    if (NULL == reply) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Reply Null");
+        return NULL;
+    }
+
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &message, DBUS_TYPE_INVALID);
+        snprintf(errorbuf, sizeof(errorbuf), "%s (%s)",
+                 dbus_message_get_error_name(reply),
+                 message != NULL ? message : "no message");
+        create_error_message(ctx, _notif_error_name_kind(dbus_message_get_error_name(reply)),
+                             errorbuf);
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+/* Both calls are sent before waiting, so asking costs one round trip */
+static bool query_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info)
+{
+    DBusConnection *conn;
+    DBusPendingCall *caps_call, *info_call;
+    DBusMessage *caps, *server;
+    DBusMessageIter args, list;
+    const char *name, *vendor, *version, *spec_version, *cap;
+    bool ok = false;
+
+    conn = get_connection(ctx);
+    if (NULL == conn)
+        return false;
+
+    caps_call = call_server(ctx, conn, "GetCapabilities");
+    info_call = call_server(ctx, conn, "GetServerInformation");
+    if (NULL == caps_call || NULL == info_call) {
+        if (caps_call != NULL)
+            dbus_pending_call_unref(caps_call);
+        if (info_call != NULL)
+            dbus_pending_call_unref(info_call);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+    dbus_connection_flush(conn);
+
+    caps = server_reply(ctx, caps_call);
+    server = server_reply(ctx, info_call);
+    if (NULL == caps || NULL == server)
+        goto out;
+
+    if (!dbus_message_get_args(server, NULL,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &vendor,
+                               DBUS_TYPE_STRING, &version,
+                               DBUS_TYPE_STRING, &spec_version,
+                               DBUS_TYPE_INVALID) ||
+        !dbus_message_iter_init(caps, &args) ||
+        dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Invalid reply signature");
+        goto out;
+    }
+
+    memset(info, 0, sizeof(*info));
+    _notif_copy_info(info->owner, dbus_message_get_sender(caps));
+    _notif_copy_info(info->name, name);
+    _notif_copy_info(info->vendor, vendor);
+    _notif_copy_info(info->version, version);
+    _notif_copy_info(info->spec_version, spec_version);
+
+    dbus_message_iter_recurse(&args, &list);
+    while (dbus_message_iter_get_arg_type(&list) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&list, &cap);
+        info->capabilities |= notif_capability(cap);
+        dbus_message_iter_next(&list);
+    }
+    ok = true;
+
+out:
+    if (caps != NULL)
+        dbus_message_unref(caps);
+    if (server != NULL)
+        dbus_message_unref(server);
+    return ok;
+}
+
+int _notif_get_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info)
+{
+    if (!ctx->server.valid) {
+        if (!query_server_info(ctx, &ctx->server.info))
+            return -1;
+        ctx->server.valid = true;
+    }
+
+    *info = ctx->server.info;
+    return 0;
+}
+
+void _notif_set_server_info(struct NotifyContext *ctx, const struct NotifyServerInfo *info)
+{
+    ctx->server.info = *info;
+    ctx->server.valid = true;
+}
+
+bool _notif_has_server_info(struct NotifyContext *ctx)
+{
+    return ctx->server.valid;
+}
+
+/*
+ * The bus cannot match uint32 arguments, so the rule covers all
+ * signals of the notification server and ids are checked on receipt.
+ * Signals of other clients' notifications still wake us, but nothing
+ * else on the bus does.
+ */
+int _notif_watch_events(struct NotifyContext *ctx)
+{
+    DBusConnection *conn;
+    DBusError err;
+    char errorbuf[255];
+
+    conn = get_connection(ctx);
+    if (NULL == conn)
+        return -1;
+
+    dbus_error_init(&err);
+    dbus_bus_add_match(conn, NOTIF_MATCH_RULE, &err);
+    if (dbus_error_is_set(&err)) {
+        snprintf(errorbuf, sizeof(errorbuf), "AddMatch Error (%s)", err.message);
+        dbus_error_free(&err);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, errorbuf);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns true when msg is a signal for notification id */
+static bool read_event(struct NotifyContext *ctx, DBusMessage *msg,
+                       unsigned int id, struct NotifyEvent *event)
+{
+    dbus_uint32_t sig_id, reason;
+    const char *key;
+
+    if (dbus_message_is_signal(msg, NOTIF_INTERFACE, "ActionInvoked")) {
+        if (!dbus_message_get_args(msg, NULL,
+                                   DBUS_TYPE_UINT32, &sig_id,
+                                   DBUS_TYPE_STRING, &key,
+                                   DBUS_TYPE_INVALID) || sig_id != id)
+            return false;
+
+        free(ctx->event_key);
+        ctx->event_key = strdup(key);
+        event->type = NOTIF_EVENT_ACTION;
+        event->key = ctx->event_key != NULL ? ctx->event_key : "";
+        event->reason = 0;
+    }
+    else if (dbus_message_is_signal(msg, NOTIF_INTERFACE, "NotificationClosed")) {
+        if (!dbus_message_get_args(msg, NULL,
+                                   DBUS_TYPE_UINT32, &sig_id,
+                                   DBUS_TYPE_UINT32, &reason,
+                                   DBUS_TYPE_INVALID) || sig_id != id)
+            return false;
+
+        event->type = NOTIF_EVENT_CLOSED;
+        event->key = NULL;
+        event->reason = reason;
+    }
+    else {
+        return false;
+    }
+
+    event->id = id;
+    return true;
+}
+
+/*
+ * Blocks in poll() on the connection socket, messages are only read
+ * when the socket becomes readable.
+ */
+int _notif_wait_event(struct NotifyContext *ctx, unsigned int id,
+                      struct NotifyEvent *event, int timeout)
+{
+    DBusConnection *conn;
+    DBusMessage *msg;
+    double deadline = now_ms() + timeout;
+    int remaining = -1;
+    bool found;
+
+    conn = get_connection(ctx);
+    if (NULL == conn)
+        return -1;
+
+    for (;;) {
+        while ((msg = dbus_connection_pop_message(conn)) != NULL) {
+            if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+                dbus_message_unref(msg);
+                create_error_message(ctx, NOTIF_ERROR_NO_BUS, "Connection closed");
+                return -1;
+            }
+
+            found = read_event(ctx, msg, id, event);
+            dbus_message_unref(msg);
+            if (found)
+                return 1;
+        }
+
+        if (timeout >= 0) {
+            remaining = (int) (deadline - now_ms());
+            if (remaining <= 0)
+                return 0;
+        }
+
+        if (!dbus_connection_read_write(conn, remaining)) {
+            create_error_message(ctx, NOTIF_ERROR_NO_BUS, "Connection closed");
+            return -1;
+        }
+    }
+}
+
+/*
+ * Phase times are added to the trace until it is unset with NULL.
+ * Timing only happens while a trace is set.
+ */
+void _notif_set_trace(struct NotifyContext *ctx, struct NotifyTrace *trace)
+{
+    ctx->trace = trace;
+}
+
+/* Metrics are recorded until unset with NULL, see struct NotifyMetrics */
+void _notif_set_metrics(struct NotifyContext *ctx, struct NotifyMetrics *metrics)
+{
+    ctx->metrics = metrics;
+}
+
+const char *_notif_get_error_message(struct NotifyContext *ctx)
+{
+    return ctx->error;
 }
 
-const char *_notif_get_error_message(void)
+int _notif_get_error_kind(struct NotifyContext *ctx)
 {
-    return _notif_error;
+    return ctx->error != NULL ? ctx->error_kind : 0;
 }
 
-void _notif_free_error_message(void)
+void _notif_free_error_message(struct NotifyContext *ctx)
 {
-    free(_notif_error);
+    free(ctx->error);
+    ctx->error = NULL;
 }
 
@@ -21,9 +21,94 @@
 
 #include "notif.h"
 
-int _notif_send_notification(struct NotifyData *data);
+#define NOTIF_INTERFACE "org.freedesktop.Notifications"
 
-const char *_notif_get_error_message(void);
-void _notif_free_error_message(void);
+/* Signals of the notification server, see _notif_watch_events() */
+#define NOTIF_MATCH_RULE "type='signal',sender='org.freedesktop.Notifications'," \
+                         "path='/org/freedesktop/Notifications'," \
+                         "interface='org.freedesktop.Notifications'"
+
+/*
+ * Backend interface. Each backend defines struct NotifyContext with
+ * everything one connection needs, so contexts share no state.
+ */
+struct NotifyContext *_notif_create_context(void);
+void _notif_free_context(struct NotifyContext *ctx);
+
+void _notif_set_private_connection(struct NotifyContext *ctx, bool private_conn);
+void _notif_close_connection(struct NotifyContext *ctx);
+void _notif_set_trace(struct NotifyContext *ctx, struct NotifyTrace *trace);
+void _notif_set_metrics(struct NotifyContext *ctx, struct NotifyMetrics *metrics);
+
+int _notif_send_notification(struct NotifyContext *ctx, struct NotifyData *data);
+int _notif_post_notification(struct NotifyContext *ctx, struct NotifyData *data);
+int _notif_close_notifications(struct NotifyContext *ctx, const unsigned int *ids, unsigned int count);
+
+/*
+ * Builds the Notify call for data as a send would, without connecting,
+ * and drops it. Returns -1 with error set when it cannot be built. For
+ * benchmarks and fuzzing of the message builder.
+ */
+int _notif_build_message(struct NotifyContext *ctx, struct NotifyData *data);
+
+void _notif_set_window_size(struct NotifyContext *ctx, unsigned int size);
+void _notif_set_reply_timeout(struct NotifyContext *ctx, int timeout);
+int _notif_queue_notification(struct NotifyContext *ctx, struct NotifyData *data,
+                              NotifyCallback callback, void *user_data);
+void _notif_flush_queue(struct NotifyContext *ctx);
+
+int _notif_get_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info);
+void _notif_set_server_info(struct NotifyContext *ctx, const struct NotifyServerInfo *info);
+bool _notif_has_server_info(struct NotifyContext *ctx);
+
+int _notif_watch_events(struct NotifyContext *ctx);
+int _notif_wait_event(struct NotifyContext *ctx, unsigned int id,
+                      struct NotifyEvent *event, int timeout);
+
+const char *_notif_get_error_message(struct NotifyContext *ctx);
+int _notif_get_error_kind(struct NotifyContext *ctx);
+void _notif_free_error_message(struct NotifyContext *ctx);
+
+/*
+ * Helpers shared by the backends for adapting notifications to the
+ * server info they cache.
+ */
+struct ServerCache {
+    struct NotifyServerInfo info;
+    bool valid;
+};
+
+/* All capabilities while nothing is cached, so nothing is dropped */
+unsigned int _notif_server_capabilities(const struct ServerCache *cache);
+
+/* Drops the cache when owner differs from the cached one, returns true then */
+bool _notif_server_seen(struct ServerCache *cache, const char *owner);
+
+bool _notif_hint_supported(unsigned int capabilities, const char *name);
+
+/* Writes in without tags and with entities decoded to out, which holds strlen(in) + 1 */
+size_t _notif_strip_markup(char *out, const char *in);
+
+void _notif_copy_info(char *out, const char *in);
+
+/*
+ * Names the first string of data that is not valid UTF-8, NULL when
+ * all are. app_name, icon, category and hints are only checked when
+ * fixed is set, for backends that check them once per template.
+ */
+const char *_notif_invalid_string(struct NotifyData *data, bool fixed);
+
+/* Whether a setter could not store its string, data is then incomplete */
+bool _notif_data_out_of_memory(struct NotifyData *data);
+
+/* NOTIF_ERROR_* kind of a D-Bus error reply, by its error name */
+int _notif_error_name_kind(const char *name);
+
+/* Metrics recording shared by the backends, metrics may be NULL */
+void _notif_metrics_observe(struct NotifyMetrics *metrics, struct NotifyHistogram *histogram,
+                            double ms);
+void _notif_metrics_connected(struct NotifyMetrics *metrics, double ms, bool reconnect);
+void _notif_metrics_result(struct NotifyMetrics *metrics, int id, int kind);
+void _notif_metrics_posted(struct NotifyMetrics *metrics, int ret, int kind);
 
 #endif /* DBUSIMP_H */
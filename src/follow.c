@@ -0,0 +1,440 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Log following: turns lines appended to files into notifications.
+ *
+ * Every file is watched with inotify for IN_MODIFY and only the bytes
+ * appended since the last read are read, split into lines and matched.
+ * Modifications reported together are read once. The directory of the
+ * file is watched as well, so a file rotated by rename and recreated
+ * is reopened and read from its start. A truncated file is read from
+ * its start again.
+ *
+ * Patterns are compiled once. Lines are matched without asking for
+ * groups first, which lets the regex engine skip tracking them for
+ * the many lines that do not match. All notifications are sent over
+ * one connection.
+ */
+
+#include "follow.h"
+#include "batch.h"
+#include "options.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FOLLOW_GROUPS 10
+
+struct FollowFile {
+    const char *path;
+    const char *name;
+    int fd;
+    int wd;
+    int dir_wd;
+    bool dirty;
+    struct BatchInput input;
+};
+
+struct Expansion {
+    char *data;
+    size_t size;
+};
+
+struct Follow {
+    int inotify;
+    struct FollowFile files[FOLLOW_MAX_FILES];
+    unsigned int file_count;
+    regex_t patterns[FOLLOW_MAX_PATTERNS];
+    unsigned int pattern_count;
+
+    struct NotifyData *data;
+    const char *summary;
+    const char *body;
+    struct Expansion summary_text;
+    struct Expansion body_text;
+    int id;
+    int ret;
+};
+
+/* Length of the UTF-8 sequence at s, 0 when it is invalid */
+static size_t utf8_length(const unsigned char *s, size_t n)
+{
+    size_t len, i;
+
+    if (s[0] < 0x80)
+        return 1;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        len = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+        len = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+        len = 4;
+    else
+        return 0;
+
+    if (len > n)
+        return 0;
+    for (i = 1; i < len; ++i) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+    }
+
+    /* overlong forms, surrogates and code points above U+10FFFF */
+    if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] > 0x9f) ||
+        (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] > 0x8f))
+        return 0;
+    return len;
+}
+
+/*
+ * Copies n bytes of log text to out, invalid UTF-8 becomes '?' since
+ * D-Bus strings must be valid. Returns the number of bytes written.
+ */
+static size_t copy_text(char *out, const char *text, size_t n)
+{
+    const unsigned char *s = (const unsigned char*) text;
+    size_t i = 0, len;
+
+    while (i < n) {
+        len = utf8_length(s + i, n - i);
+        if (len == 0) {
+            out[i++] = '?';
+            continue;
+        }
+        memcpy(out + i, s + i, len);
+        i += len;
+    }
+    return n;
+}
+
+/* Replaces \0 to \9 in template with groups of line, \\ with a backslash */
+static const char *expand(struct Expansion *e, const char *template, const char *line,
+                          const regmatch_t *groups)
+{
+    const char *t;
+    char *data;
+    size_t len = 0, pos = 0;
+    int g;
+
+    for (t = template; *t != '\0'; ++t) {
+        if (t[0] == '\\' && t[1] >= '0' && t[1] <= '9') {
+            g = *++t - '0';
+            if (groups[g].rm_so >= 0)
+                len += groups[g].rm_eo - groups[g].rm_so;
+        }
+        else {
+            t += t[0] == '\\' && t[1] == '\\';
+            ++len;
+        }
+    }
+
+    if (len + 1 > e->size) {
+        data = (char*) realloc(e->data, len + 1);
+        if (data == NULL)
+            return NULL;
+        e->data = data;
+        e->size = len + 1;
+    }
+
+    for (t = template; *t != '\0'; ++t) {
+        if (t[0] == '\\' && t[1] >= '0' && t[1] <= '9') {
+            g = *++t - '0';
+            if (groups[g].rm_so >= 0)
+                pos += copy_text(e->data + pos, line + groups[g].rm_so,
+                                 groups[g].rm_eo - groups[g].rm_so);
+        }
+        else {
+            t += t[0] == '\\' && t[1] == '\\';
+            e->data[pos++] = *t;
+        }
+    }
+
+    e->data[pos] = '\0';
+    return e->data;
+}
+
+static void send_match(struct Follow *f, const char *line, const regmatch_t *groups)
+{
+    const char *summary, *body;
+    int id;
+
+    summary = expand(&f->summary_text, f->summary, line, groups);
+    body = expand(&f->body_text, f->body, line, groups);
+    if (summary == NULL || body == NULL) {
+        fprintf(errout, "Error: Out Of Memory!\n");
+        f->ret = 1;
+        return;
+    }
+
+    notif_set_summary(f->data, summary);
+    notif_set_body(f->data, body);
+
+    /* with a tag, every match replaces the notification of the last one */
+    if (notif_get_tag(f->data) != NULL && f->id > 0)
+        notif_set_replaces_id(f->data, f->id);
+
+    id = notif_send_notification(f->data);
+    if (id == -1) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        f->ret = 1;
+        return;
+    }
+
+    f->id = id;
+    fprintf(notif_get_id_file(f->data), "%i\n", id);
+    fflush(notif_get_id_file(f->data));
+}
+
+static void match_line(struct Follow *f, char *line)
+{
+    regmatch_t groups[FOLLOW_GROUPS];
+    size_t len = strlen(line);
+    unsigned int i;
+
+    if (len > 0 && line[len - 1] == '\r')
+        line[len - 1] = '\0';
+
+    if (f->pattern_count == 0) {
+        groups[0].rm_so = 0;
+        groups[0].rm_eo = strlen(line);
+        for (i = 1; i < FOLLOW_GROUPS; ++i)
+            groups[i].rm_so = groups[i].rm_eo = -1;
+        send_match(f, line, groups);
+        return;
+    }
+
+    for (i = 0; i < f->pattern_count; ++i) {
+        if (regexec(&f->patterns[i], line, 0, NULL, 0) != 0)
+            continue;
+        if (regexec(&f->patterns[i], line, FOLLOW_GROUPS, groups, 0) == 0)
+            send_match(f, line, groups);
+        return;
+    }
+}
+
+/* Reads what was appended since the last read and matches complete lines */
+static void read_file(struct Follow *f, struct FollowFile *file)
+{
+    struct stat st;
+    char *line;
+    int ret;
+
+    file->dirty = false;
+
+    /* truncated, start over */
+    if (fstat(file->fd, &st) == 0 && st.st_size < lseek(file->fd, 0, SEEK_CUR)) {
+        lseek(file->fd, 0, SEEK_SET);
+        file->input.len = file->input.start = 0;
+    }
+
+    while ((ret = batch_input_fill(&file->input)) > 0) {
+        while ((line = batch_input_line(&file->input)) != NULL)
+            match_line(f, line);
+    }
+
+    if (ret < 0) {
+        fprintf(errout, "Could not read %s: %s\n", file->path, strerror(errno));
+        f->ret = 1;
+    }
+
+    /* end of file only means nothing more was written yet */
+    file->input.eof = false;
+}
+
+static bool open_file(struct Follow *f, struct FollowFile *file, bool at_end)
+{
+    file->fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+        fprintf(errout, "Could not open %s: %s\n", file->path, strerror(errno));
+        return false;
+    }
+
+    file->wd = inotify_add_watch(f->inotify, file->path, IN_MODIFY);
+    if (file->wd < 0) {
+        fprintf(errout, "Could not watch %s: %s\n", file->path, strerror(errno));
+        close(file->fd);
+        file->fd = -1;
+        return false;
+    }
+
+    if (at_end)
+        lseek(file->fd, 0, SEEK_END);
+    batch_input_init(&file->input, file->fd);
+    return true;
+}
+
+/* A new file took the name, finish the old one and read the new one from its start */
+static void reopen_file(struct Follow *f, struct FollowFile *file)
+{
+    struct stat old, st;
+
+    if (fstat(file->fd, &old) == 0 && stat(file->path, &st) == 0 &&
+        old.st_dev == st.st_dev && old.st_ino == st.st_ino)
+        return;
+
+    read_file(f, file);
+    inotify_rm_watch(f->inotify, file->wd);
+    batch_input_free(&file->input);
+    close(file->fd);
+
+    if (!open_file(f, file, false))
+        f->ret = 1;
+    else
+        read_file(f, file);
+}
+
+static bool watch_directory(struct Follow *f, struct FollowFile *file)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(file->path, '/');
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        file->name = file->path;
+    }
+    else if (slash == file->path) {
+        strcpy(dir, "/");
+        file->name = slash + 1;
+    }
+    else if ((size_t) (slash - file->path) < sizeof(dir)) {
+        memcpy(dir, file->path, slash - file->path);
+        dir[slash - file->path] = '\0';
+        file->name = slash + 1;
+    }
+    else {
+        return false;
+    }
+
+    file->dir_wd = inotify_add_watch(f->inotify, dir, IN_CREATE | IN_MOVED_TO);
+    if (file->dir_wd < 0) {
+        fprintf(errout, "Could not watch %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void handle_events(struct Follow *f, const char *buf, ssize_t len)
+{
+    const struct inotify_event *event;
+    struct FollowFile *file;
+    ssize_t pos;
+    unsigned int i;
+
+    for (pos = 0; pos < len; pos += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event*) (buf + pos);
+
+        for (i = 0; i < f->file_count; ++i) {
+            file = &f->files[i];
+            if (event->wd == file->wd && (event->mask & IN_MODIFY))
+                file->dirty = true;
+            else if (event->wd == file->dir_wd && event->len > 0 &&
+                     strcmp(event->name, file->name) == 0 && file->fd >= 0)
+                reopen_file(f, file);
+        }
+    }
+
+    for (i = 0; i < f->file_count; ++i) {
+        if (f->files[i].dirty)
+            read_file(f, &f->files[i]);
+    }
+}
+
+static void free_follow(struct Follow *f)
+{
+    unsigned int i;
+
+    for (i = 0; i < f->file_count; ++i) {
+        if (f->files[i].fd >= 0) {
+            batch_input_free(&f->files[i].input);
+            close(f->files[i].fd);
+        }
+    }
+    for (i = 0; i < f->pattern_count; ++i)
+        regfree(&f->patterns[i]);
+    if (f->inotify >= 0)
+        close(f->inotify);
+    free(f->summary_text.data);
+    free(f->body_text.data);
+}
+
+int follow_run(struct NotifyData *data, const char **files, unsigned int file_count,
+               const char **patterns, unsigned int pattern_count)
+{
+    static struct Follow f;
+    char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char error[256];
+    ssize_t len;
+    unsigned int i;
+    int ret;
+
+    memset(&f, 0, sizeof(f));
+    f.data = data;
+    f.summary = notif_get_summary(data);
+    f.body = notif_get_body(data);
+    f.inotify = inotify_init1(IN_CLOEXEC);
+    if (f.inotify < 0) {
+        perror("Could not initialize inotify");
+        return 1;
+    }
+
+    for (i = 0; i < pattern_count; ++i) {
+        ret = regcomp(&f.patterns[i], patterns[i], REG_EXTENDED);
+        if (ret != 0) {
+            regerror(ret, &f.patterns[i], error, sizeof(error));
+            fprintf(errout, "Invalid pattern %s: %s\n", patterns[i], error);
+            free_follow(&f);
+            return 1;
+        }
+        ++f.pattern_count;
+    }
+
+    for (i = 0; i < file_count; ++i) {
+        f.files[i].path = files[i];
+        f.files[i].fd = -1;
+        f.file_count = i + 1;
+        if (!watch_directory(&f, &f.files[i]) || !open_file(&f, &f.files[i], true)) {
+            free_follow(&f);
+            return 1;
+        }
+    }
+
+    for (;;) {
+        len = read(f.inotify, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            perror("Could not read inotify events");
+            f.ret = 1;
+            break;
+        }
+        handle_events(&f, buf, len);
+    }
+
+    free_follow(&f);
+    return f.ret;
+}
@@ -0,0 +1,33 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include "notif.h"
+
+/*
+ * Follows files like tail -F and sends data for every appended line
+ * matching one of patterns (POSIX extended regular expressions), all
+ * lines without patterns. \0 to \9 in summary and body of data are
+ * replaced with the match and its groups. Runs until killed.
+ */
+int follow_run(struct NotifyData *data, const char **files, unsigned int file_count,
+               const char **patterns, unsigned int pattern_count);
+
+#endif /* FOLLOW_H */
@@ -0,0 +1,299 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * ID store: one file mapping keys to the ID of the notification last
+ * sent with the key, shared by all notify-desktop invocations.
+ *
+ * The file is a fixed size hash table of 64 byte slots, memory-mapped
+ * and probed linearly, so lookups and updates take constant time with
+ * any number of keys in use. Adding a key takes flock() on the whole
+ * file. The slot of a key is locked with an OFD byte-range lock for
+ * the whole send, invocations with different keys run in parallel.
+ *
+ * Keys may form groups, group/name belongs to group. A group is taken
+ * under the file lock, so no key of it can be added meanwhile.
+ */
+
+#define _GNU_SOURCE
+#include "idstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IDSTORE_MAGIC "NDIDS1"
+
+struct IdStoreHeader {
+    char magic[8];
+    uint32_t slots;
+    uint32_t used;
+    char reserved[48];
+};
+
+struct IdStoreSlot {
+    char key[IDSTORE_KEY_SIZE];
+    uint32_t hash;
+    uint32_t id;
+};
+
+struct IdStore {
+    int fd;
+    struct IdStoreHeader *header;
+    struct IdStoreSlot *slots;
+    struct IdStoreSlot *slot;
+    size_t size;
+};
+
+static uint32_t hash_key(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *key != '\0'; ++key) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool default_path(char *path, size_t size, char *error, size_t error_size)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int len;
+
+    if (runtime == NULL || runtime[0] == '\0') {
+        snprintf(error, error_size, "XDG_RUNTIME_DIR is not set, use --id-store=PATH");
+        return false;
+    }
+
+    len = snprintf(path, size, "%s/notify-desktop/ids", runtime);
+    if (len < 0 || (size_t) len >= size) {
+        snprintf(error, error_size, "XDG_RUNTIME_DIR is too long, use --id-store=PATH");
+        return false;
+    }
+
+    snprintf(path, size, "%s/notify-desktop", runtime);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        snprintf(error, error_size, "Could not create the ID store directory: %s",
+                 strerror(errno));
+        return false;
+    }
+
+    snprintf(path, size, "%s/notify-desktop/ids", runtime);
+    return true;
+}
+
+/* New files are sized and given a header under the file lock */
+static bool init_file(int fd, size_t size)
+{
+    struct IdStoreHeader header;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return false;
+    if (st.st_size != 0)
+        return (size_t) st.st_size == size;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IDSTORE_MAGIC, sizeof(IDSTORE_MAGIC));
+    header.slots = IDSTORE_SLOTS;
+
+    return ftruncate(fd, size) == 0 &&
+           pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+}
+
+struct IdStore *idstore_open(const char *path, char *error, size_t error_size)
+{
+    char buf[4096];
+    struct IdStore *store;
+    size_t size;
+    void *map;
+    int fd;
+    bool ok;
+
+    if (path == NULL) {
+        if (!default_path(buf, sizeof(buf), error, error_size))
+            return NULL;
+        path = buf;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        snprintf(error, error_size, "Could not open the ID store: %s", strerror(errno));
+        return NULL;
+    }
+
+    size = sizeof(struct IdStoreHeader) + IDSTORE_SLOTS * sizeof(struct IdStoreSlot);
+
+    flock(fd, LOCK_EX);
+    ok = init_file(fd, size);
+    flock(fd, LOCK_UN);
+
+    map = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED ||
+        memcmp(((struct IdStoreHeader*) map)->magic, IDSTORE_MAGIC, sizeof(IDSTORE_MAGIC)) != 0 ||
+        ((struct IdStoreHeader*) map)->slots != IDSTORE_SLOTS) {
+        snprintf(error, error_size, "Invalid ID store %s", path);
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        close(fd);
+        return NULL;
+    }
+
+    store = (struct IdStore*) malloc(sizeof(struct IdStore));
+    if (store == NULL) {
+        snprintf(error, error_size, "Out Of Memory!");
+        munmap(map, size);
+        close(fd);
+        return NULL;
+    }
+    store->fd = fd;
+    store->header = (struct IdStoreHeader*) map;
+    store->slots = (struct IdStoreSlot*) (store->header + 1);
+    store->slot = NULL;
+    store->size = size;
+    return store;
+}
+
+void idstore_close(struct IdStore *store)
+{
+    if (store == NULL)
+        return;
+
+    /* closing releases the slot lock */
+    munmap(store->header, store->size);
+    close(store->fd);
+    free(store);
+}
+
+static struct IdStoreSlot *find_slot(struct IdStore *store, const char *key, uint32_t hash, bool insert)
+{
+    struct IdStoreSlot *slot;
+    uint32_t i, n;
+
+    for (n = 0, i = hash & (IDSTORE_SLOTS - 1); n < IDSTORE_SLOTS; ++n, i = (i + 1) & (IDSTORE_SLOTS - 1)) {
+        slot = &store->slots[i];
+        if (slot->key[0] == '\0') {
+            if (!insert)
+                return NULL;
+            memcpy(slot->key, key, strlen(key) + 1);
+            slot->id = 0;
+            ++store->header->used;
+
+            /* lookups without the file lock match on hash, publish it last */
+            __atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+            return slot;
+        }
+        if (__atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE) == hash && strcmp(slot->key, key) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+static bool lock_slot(struct IdStore *store, struct IdStoreSlot *slot,
+                      char *error, size_t error_size)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (char*) slot - (char*) store->header;
+    lock.l_len = sizeof(struct IdStoreSlot);
+    while (fcntl(store->fd, F_OFD_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            snprintf(error, error_size, "Could not lock the ID store: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+int idstore_lookup(struct IdStore *store, const char *key, unsigned int *id,
+                   char *error, size_t error_size)
+{
+    uint32_t hash = hash_key(key);
+    struct IdStoreSlot *slot;
+
+    if (key[0] == '\0' || strlen(key) >= IDSTORE_KEY_SIZE) {
+        snprintf(error, error_size, "ID key must be 1 to %i characters long",
+                 IDSTORE_KEY_SIZE - 1);
+        return -1;
+    }
+
+    /* known keys are found without the file lock, slots are never removed */
+    slot = find_slot(store, key, hash, false);
+    if (slot == NULL) {
+        flock(store->fd, LOCK_EX);
+        slot = find_slot(store, key, hash, true);
+        flock(store->fd, LOCK_UN);
+    }
+    if (slot == NULL) {
+        snprintf(error, error_size, "ID store is full");
+        return -1;
+    }
+
+    if (!lock_slot(store, slot, error, error_size))
+        return -1;
+
+    store->slot = slot;
+    *id = slot->id;
+    return 0;
+}
+
+void idstore_update(struct IdStore *store, unsigned int id)
+{
+    if (store->slot != NULL)
+        store->slot->id = id;
+}
+
+int idstore_take_group(struct IdStore *store, const char *group, unsigned int *ids,
+                       char *error, size_t error_size)
+{
+    size_t len = strlen(group);
+    struct IdStoreSlot *slot;
+    int i, count = 0;
+
+    flock(store->fd, LOCK_EX);
+    for (i = 0; i < IDSTORE_SLOTS; ++i) {
+        slot = &store->slots[i];
+        if (strncmp(slot->key, group, len) != 0 ||
+            (slot->key[len] != '\0' && slot->key[len] != '/'))
+            continue;
+
+        /* waits for a running send to store its ID */
+        if (!lock_slot(store, slot, error, error_size)) {
+            count = -1;
+            break;
+        }
+        if (slot->id != 0)
+            ids[count++] = slot->id;
+        slot->id = 0;
+    }
+    flock(store->fd, LOCK_UN);
+
+    return count;
+}
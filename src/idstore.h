@@ -0,0 +1,54 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef IDSTORE_H
+#define IDSTORE_H
+
+#include <stddef.h>
+
+#define IDSTORE_KEY_SIZE 56
+#define IDSTORE_SLOTS 4096
+
+struct IdStore;
+
+/*
+ * Opens the ID store at path, or $XDG_RUNTIME_DIR/notify-desktop/ids
+ * when path is NULL. On failure NULL is returned and the reason is
+ * written to error, like the other functions returning -1.
+ */
+struct IdStore *idstore_open(const char *path, char *error, size_t error_size);
+void idstore_close(struct IdStore *store);
+
+/*
+ * Finds or creates the slot of key and locks it until the store is
+ * closed, so invocations using the same key run one after another.
+ * id is the last stored ID, 0 for a new key.
+ */
+int idstore_lookup(struct IdStore *store, const char *key, unsigned int *id,
+                   char *error, size_t error_size);
+void idstore_update(struct IdStore *store, unsigned int id);
+
+/*
+ * Stores the IDs of group and of all keys below it (group/...) into
+ * ids, which holds IDSTORE_SLOTS entries, and clears them. Their slots
+ * stay locked until the store is closed. Returns the number of IDs.
+ */
+int idstore_take_group(struct IdStore *store, const char *group, unsigned int *ids,
+                       char *error, size_t error_size);
+
+#endif /* IDSTORE_H */
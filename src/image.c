@@ -0,0 +1,155 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#include "image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void unload_image(struct NotifyImage *image)
+{
+    free((void*) image->pixels);
+    free(image->path);
+    memset(image, 0, sizeof(*image));
+}
+
+static bool unchanged(const struct NotifyImage *image, const struct stat *st)
+{
+    return image->dev == st->st_dev && image->ino == st->st_ino &&
+           image->size == (size_t) st->st_size &&
+           image->mtime.tv_sec == st->st_mtim.tv_sec &&
+           image->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Pixels are copied rather than mapped: a mapped file truncated by
+ * another process would raise SIGBUS on the next send.
+ */
+static bool load_image(struct NotifyImage *image, const char *path, const struct stat *st,
+                       char *error, size_t size)
+{
+    unsigned char *pixels;
+    size_t len = 0;
+    ssize_t ret = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(error, size, "Cannot open image %s (%s)", path, strerror(errno));
+        return false;
+    }
+
+    pixels = (unsigned char*) malloc(st->st_size);
+    image->path = strdup(path);
+    if (pixels == NULL || image->path == NULL) {
+        close(fd);
+        free(pixels);
+        free(image->path);
+        image->path = NULL;
+        snprintf(error, size, "Out Of Memory!");
+        return false;
+    }
+
+    while (len < (size_t) st->st_size) {
+        ret = read(fd, pixels + len, st->st_size - len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        len += ret;
+    }
+    close(fd);
+
+    /* changed while reading */
+    if (len < (size_t) st->st_size) {
+        free(pixels);
+        free(image->path);
+        image->path = NULL;
+        snprintf(error, size, "Cannot read image %s (%s)", path,
+                 ret < 0 ? strerror(errno) : "file was truncated");
+        return false;
+    }
+
+    image->dev = st->st_dev;
+    image->ino = st->st_ino;
+    image->mtime = st->st_mtim;
+    image->pixels = pixels;
+    image->size = st->st_size;
+    return true;
+}
+
+const struct NotifyImage *image_cache_get(struct ImageCache *cache, const char *path,
+                                          int width, int height,
+                                          char *error, size_t size)
+{
+    struct NotifyImage *image = NULL;
+    struct stat st;
+    size_t pixels;
+    unsigned int i;
+
+    if (stat(path, &st) < 0) {
+        snprintf(error, size, "Cannot open image %s (%s)", path, strerror(errno));
+        return NULL;
+    }
+
+    pixels = (size_t) width * height;
+    if (width <= 0 || height <= 0 ||
+        ((size_t) st.st_size != pixels * 3 && (size_t) st.st_size != pixels * 4)) {
+        snprintf(error, size, "Image %s is not %ix%i RGB or RGBA", path, width, height);
+        return NULL;
+    }
+
+    for (i = 0; i < IMAGE_CACHE_SIZE; ++i) {
+        if (cache->images[i].path != NULL && strcmp(cache->images[i].path, path) == 0) {
+            image = &cache->images[i];
+            break;
+        }
+    }
+
+    if (image != NULL && !unchanged(image, &st))
+        unload_image(image);
+
+    if (image == NULL) {
+        image = &cache->images[cache->next];
+        cache->next = (cache->next + 1) % IMAGE_CACHE_SIZE;
+        unload_image(image);
+    }
+
+    if (image->pixels == NULL && !load_image(image, path, &st, error, size))
+        return NULL;
+
+    /* the same pixels may be sent with another width and height */
+    image->width = width;
+    image->height = height;
+    image->channels = image->size / pixels;
+    image->rowstride = width * image->channels;
+    return image;
+}
+
+void image_cache_free(struct ImageCache *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < IMAGE_CACHE_SIZE; ++i)
+        unload_image(&cache->images[i]);
+}
@@ -0,0 +1,64 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define IMAGE_CACHE_SIZE 4
+
+/* Raw pixels of an image-data hint, read from the file */
+struct NotifyImage {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+
+    const unsigned char *pixels;
+    size_t size;
+    int width;
+    int height;
+    int rowstride;
+    int channels;
+};
+
+/*
+ * Images recently used by one context. Pixels are kept until the file
+ * changes or the image is evicted, so sending the same image again
+ * costs one stat() instead of reading the file.
+ */
+struct ImageCache {
+    struct NotifyImage images[IMAGE_CACHE_SIZE];
+    unsigned int next;
+};
+
+/*
+ * Returns the image of the raw RGB or RGBA file at path, which must
+ * hold exactly width * height pixels. On failure NULL is returned and
+ * the reason is written to error.
+ */
+const struct NotifyImage *image_cache_get(struct ImageCache *cache, const char *path,
+                                          int width, int height,
+                                          char *error, size_t size);
+void image_cache_free(struct ImageCache *cache);
+
+#endif /* IMAGE_H */
@@ -17,178 +17,680 @@
 * ============================================================ */
 
 #include "notif.h"
+#include "options.h"
+#include "daemon.h"
+#include "coalesce.h"
+#include "aggregate.h"
+#include "priority.h"
+#include "idstore.h"
+#include "servercache.h"
+#include "follow.h"
+#include "metrics.h"
 
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
 
-static int parse_urgency(char *string)
+#define RETRY_BASE_MS 100
+#define RETRY_MAX_MS 10000
+
+static struct NotifyTrace trace;
+static struct NotifyMetrics *metrics;
+static const char *metrics_file;
+
+static double clock_ms(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Startup is the CPU time used before main, loading and initialising
+ * the process. Send phases are summed over all notifications, total
+ * is the time from main until exit.
+ */
+static void print_trace(int format, double startup, double parse, double total)
+{
+    if (format == TRACE_JSON) {
+        fprintf(stderr, "{\"startup_ms\":%.3f,\"parse_ms\":%.3f,\"connect_ms\":%.3f,"
+                "\"marshal_ms\":%.3f,\"flush_ms\":%.3f,\"reply_ms\":%.3f,"
+                "\"total_ms\":%.3f,\"count\":%u}\n",
+                startup, parse,
+                trace.phase[NOTIF_TRACE_CONNECT], trace.phase[NOTIF_TRACE_MARSHAL],
+                trace.phase[NOTIF_TRACE_FLUSH], trace.phase[NOTIF_TRACE_REPLY],
+                total, trace.count);
+        return;
+    }
+
+    fprintf(stderr, "trace: startup %.3fms parse %.3fms connect %.3fms marshal %.3fms "
+            "flush %.3fms reply %.3fms total %.3fms count %u\n",
+            startup, parse,
+            trace.phase[NOTIF_TRACE_CONNECT], trace.phase[NOTIF_TRACE_MARSHAL],
+            trace.phase[NOTIF_TRACE_FLUSH], trace.phase[NOTIF_TRACE_REPLY],
+            total, trace.count);
+}
+
+static int exit_code(int kind)
+{
+    switch (kind) {
+    case NOTIF_ERROR_TIMEOUT:
+        return EXIT_TIMEOUT;
+    case NOTIF_ERROR_NO_SERVER:
+        return EXIT_NO_SERVER;
+    case NOTIF_ERROR_NO_BUS:
+        return EXIT_NO_BUS;
+    default:
+        return 1;
+    }
+}
+
+/* Prints the error of the last library call, returns the exit code for it */
+static int library_error(void)
+{
+    int kind = notif_get_error_kind();
+
+    fprintf(errout, "Error: %s\n", notif_get_error_message());
+    notif_free_error_message();
+    return exit_code(kind);
+}
+
+/*
+ * Exponential backoff with jitter: the n-th retry waits between half
+ * and all of RETRY_BASE_MS * 2^n, so parallel invocations that failed
+ * together do not retry together.
+ */
+static void backoff(int attempt)
+{
+    struct timespec ts;
+    long limit, delay;
+
+    limit = attempt < 16 ? (long) RETRY_BASE_MS << attempt : RETRY_MAX_MS;
+    if (limit > RETRY_MAX_MS)
+        limit = RETRY_MAX_MS;
+    delay = limit / 2 + rand() % (limit / 2 + 1);
+
+    ts.tv_sec = delay / 1000;
+    ts.tv_nsec = (delay % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Notifications the server may not support as they are */
+static bool needs_adapting(struct NotifyData *data)
+{
+    const char *body = notif_get_body(data);
+    const char *name;
+    unsigned int i;
+
+    if (notif_get_action_count(data) > 0 || (body != NULL && strpbrk(body, "<&") != NULL))
+        return true;
+
+    /* sound hints are dropped without the sound capability */
+    for (i = 0; i < notif_get_hint_count(data); ++i) {
+        name = notif_get_hint(data, i)->name;
+        if (strncmp(name, "sound-", 6) == 0 || strcmp(name, "suppress-sound") == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Asks the server and updates the cache file, errors are ignored */
+static void query_server_info(void)
+{
+    struct NotifyServerInfo info;
+
+    if (notif_get_server_info(&info) == 0)
+        server_cache_save(&info);
+    else
+        notif_free_error_message();
+}
+
+/*
+ * Seeds the connection with the cached server info, so nothing has to
+ * be asked before sending. Without a cache the server is only asked
+ * when data needs adapting, or always when data is NULL (many
+ * notifications follow). Returns whether the cache was used.
+ */
+static bool load_server_info(struct NotifyData *data)
+{
+    struct NotifyServerInfo info;
+
+    if (server_cache_load(&info)) {
+        notif_set_server_info(&info);
+        return true;
+    }
+
+    if (data == NULL || needs_adapting(data))
+        query_server_info();
+    return false;
+}
+
+/* The library drops the info when replies come from another server */
+static void refresh_server_info(void)
+{
+    if (!notif_has_server_info())
+        query_server_info();
+}
+
+static int print_server_info(void)
+{
+    static const char *names[] = {
+        "actions", "body", "body-hyperlinks", "body-images", "body-markup",
+        "icon-multi", "icon-static", "persistence", "sound"
+    };
+    struct NotifyServerInfo info;
+    unsigned int i;
+
+    if (notif_get_server_info(&info) != 0)
+        return library_error();
+    server_cache_save(&info);
+
+    printf("name: %s\nvendor: %s\nversion: %s\nspec version: %s\ncapabilities:",
+           info.name, info.vendor, info.version, info.spec_version);
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (info.capabilities & notif_capability(names[i]))
+            printf(" %s", names[i]);
+    }
+    printf("\n");
+    return 0;
+}
+
+static int print_metrics(void)
+{
+    if (metrics == NULL) {
+        fprintf(errout, "No metrics, XDG_RUNTIME_DIR is not set or not writable\n");
+        return 1;
+    }
+    return metrics_export(metrics, metrics_file) == 0 ? 0 : 1;
+}
+
+/* Rewrites the metrics file while the daemon runs */
+static void export_metrics(void)
+{
+    if (metrics != NULL)
+        metrics_export(metrics, metrics_file);
+}
+
+/* Sends data once, returns 0 or the NOTIF_ERROR_* kind with its message in error */
+static int send_once(struct NotifyData *data, struct Options *opts, int *id,
+                     char *error, size_t size)
+{
+    int ret;
+
+    *id = 0;
+
+    /*
+     * single notifications go through the daemon when it is running,
+     * except with --wait, signals arrive on our own connection
+     */
+    if (!opts->batch && !opts->wait) {
+        ret = daemon_send(data, opts->no_wait, opts->timeout, id,
+                          opts->trace != TRACE_OFF ? &trace : NULL, error, size);
+        if (ret != -1)
+            return ret;
+    }
+
+    if (opts->no_wait)
+        ret = notif_post_notification(data);
+    else
+        ret = *id = notif_send_notification(data);
+
+    if (ret == -1) {
+        snprintf(error, size, "%s", notif_get_error_message());
+        ret = notif_get_error_kind();
+        notif_free_error_message();
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Sends data and prints its ID, which is also stored in id (0 with
+ * --no-wait). Timeouts and a missing server or bus are retried up to
+ * --retries times. Returns the exit code.
+ */
+static int send_data(struct NotifyData *data, struct Options *opts, int *id)
+{
+    char error[512];
+    int kind, attempt;
+
+    if (opts->no_wait && notif_get_id_file(data) != stdout) {
+        fprintf(errout, "--no-wait cannot be used with -R\n");
+        return 1;
+    }
+
+    for (attempt = 0; ; ++attempt) {
+        kind = send_once(data, opts, id, error, sizeof(error));
+        if (kind == 0 || kind == NOTIF_ERROR_OTHER || attempt >= opts->retries)
+            break;
+        backoff(attempt);
+    }
+
+    if (kind != 0) {
+        fprintf(errout, "Error: %s\n", error);
+        return exit_code(kind);
+    }
+
+    if (!opts->no_wait)
+        fprintf(notif_get_id_file(data), "%i\n", *id);
+    return 0;
+}
+
+/* Tags share the ID store with --id-key names, in their own namespace */
+static bool tag_key(char *key, const char *tag)
+{
+    int len = snprintf(key, IDSTORE_KEY_SIZE, "tag:%s", tag);
+
+    if (tag[0] == '\0' || len >= IDSTORE_KEY_SIZE) {
+        fprintf(errout, "Tag must be 1 to %i characters long\n", IDSTORE_KEY_SIZE - 5);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Replaces the notification last sent with the same key, --id-key
+ * or tag. The slot of the key stays locked until the new ID is stored.
+ */
+static int send_keyed(struct NotifyData *data, struct Options *opts, const char *key, int *id)
+{
+    struct IdStore *store;
+    unsigned int replaces_id;
+    char error[512];
+    int ret;
+
+    if (notif_get_replaces_id(data) != 0 || notif_get_id_file(data) != stdout) {
+        fprintf(errout, "--id-key cannot be used with -r or -R\n");
+        return 1;
+    }
+    if (opts->no_wait) {
+        fprintf(errout, "--no-wait cannot be used with --id-key\n");
+        return 1;
+    }
+
+    store = idstore_open(opts->id_store, error, sizeof(error));
+    if (store == NULL) {
+        fprintf(errout, "%s\n", error);
+        return 1;
+    }
+
+    if (idstore_lookup(store, key, &replaces_id, error, sizeof(error)) != 0) {
+        fprintf(errout, "%s\n", error);
+        idstore_close(store);
+        return 1;
+    }
+
+    notif_set_replaces_id(data, replaces_id);
+    ret = send_data(data, opts, id);
+    if (ret == 0)
+        idstore_update(store, *id);
+
+    idstore_close(store);
+    return ret;
+}
+
+/*
+ * Closes the notifications of all tags in the group with pipelined
+ * CloseNotification calls. Their slots stay locked until all are
+ * closed, so a parallel send with one of the tags creates a new one.
+ */
+static int close_group(struct Options *opts)
+{
+    static unsigned int ids[IDSTORE_SLOTS];
+    char key[IDSTORE_KEY_SIZE], error[512];
+    struct IdStore *store;
+    int count, ret = 0;
+
+    if (!tag_key(key, opts->close_tag))
+        return 1;
+
+    store = idstore_open(opts->id_store, error, sizeof(error));
+    if (store == NULL) {
+        fprintf(errout, "%s\n", error);
+        return 1;
+    }
+
+    count = idstore_take_group(store, key, ids, error, sizeof(error));
+    if (count < 0) {
+        fprintf(errout, "%s\n", error);
+        ret = 1;
+    }
+    else if (notif_close_notifications(ids, count) != 0)
+        ret = library_error();
+
+    idstore_close(store);
+    return ret;
+}
+
+/* Blocks until an action of id is invoked or it is closed, prints which */
+static int wait_event(int id)
+{
+    static const char *reasons[] = { "undefined", "expired", "dismissed", "closed", "undefined" };
+    struct NotifyEvent event;
+
+    if (notif_wait_event(id, &event, -1) != 1)
+        return library_error();
+
+    if (event.type == NOTIF_EVENT_ACTION)
+        printf("%s\n", event.key);
+    else
+        printf("closed:%s\n", event.reason < 5 ? reasons[event.reason] : "undefined");
+    return 0;
+}
+
+/*
+ * Requests are sent one at a time, so one data is reused for all of
+ * them and its strings point into the request.
+ */
+static void handle_request(char *request, char *reply, size_t size)
 {
-    if (strcmp(string, "low") == 0)
-        return NOTIF_URGENCY_LOW;
-    else if (strcmp(string, "normal") == 0)
-        return NOTIF_URGENCY_NORMAL;
-    else if (strcmp(string, "critical") == 0)
-        return NOTIF_URGENCY_CRITICAL;
+    static struct NotifyData *data = NULL;
+    char *c;
+    int id;
+
+    if (data == NULL) {
+        data = notif_create_data();
+        if (data == NULL) {
+            snprintf(reply, size, "error %d Out Of Memory!", NOTIF_ERROR_OTHER);
+            return;
+        }
+        notif_borrow_strings(data, true);
+    }
+    else {
+        notif_reset_data(data);
+    }
+
+    if (parse_record(request, data) != PARSE_OK) {
+        snprintf(reply, size, "error %d Invalid request", NOTIF_ERROR_OTHER);
+    }
+    else if ((id = notif_send_notification(data)) == -1) {
+        snprintf(reply, size, "error %d %s", notif_get_error_kind(), notif_get_error_message());
+        notif_free_error_message();
+    }
+    else {
+        snprintf(reply, size, "%i", id);
+        refresh_server_info();
+    }
 
-    return NOTIF_ERROR;
+    /* reply must stay on one line */
+    for (c = reply; *c != '\0'; ++c) {
+        if (*c == '\n')
+            *c = ' ';
+    }
 }
 
-static void show_help(void)
+static void batch_sent(struct NotifyData *data, int id, void *user_data)
 {
-    printf("Usage:\n"
-           "notify-desktop [OPTION...] <SUMMARY> [BODY] - create a notification\n"
-           "\n"
-           "Help Options:\n"
-           "  -h, --help               Show help options\n"
-           "  -v, --version            Version of the application\n"
-           "\n");
-    printf("Application Options:\n"
-           "  -r, --replaces-id=ID     Specifies the notifications ID that will be replaced\n"
-           "  -R, --id-file=PATH       Specifies the path to a file for storing the id that will be replace\n"
-           "  -u, --urgency=LEVEL      Specifies the urgency level (low, normal, critical)\n"
-           "  -t, --expire-time=TIME   Specifies the timeout in ms to expire the notification\n"
-           "  -a, --app-name=APP_NAME  Specifies the app name for the icon\n"
-           "  -i, --icon=ICON          Specifies an icon filename or stock icon to display\n"
-           "  -c, --category=TYPE      Specifies the notification category\n"
-           "\n");
-    printf("Application Output:\n"
-           "   On success:             Prints ID of sent notification and returns 0\n"
-           "   On failure:             Prints error and returns 1\n"
-           "\n");
+    int *ret = (int*) user_data;
+
+    if (id == -1) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        *ret = 1;
+    }
+    else {
+        fprintf(notif_get_id_file(data), "%i\n", id);
+    }
+
+    notif_free_data(data);
 }
 
-static void show_version(void)
+/*
+ * Records are pipelined: up to window notifications are in flight
+ * and IDs are printed in input order as replies come back.
+ */
+static int run_batch(struct Options *opts)
 {
-    printf("notify-desktop 0.2.0\n");
+    const char *path = opts->batch_file;
+    struct NotifyData *data;
+    FILE *file;
+    char *line = NULL;
+    size_t size = 0;
+    int parsed, id, lineno = 0, ret = 0;
+
+    if (path == NULL || strcmp(path, "-") == 0) {
+        file = stdin;
+    }
+    else {
+        file = fopen(path, "r");
+        if (file == NULL) {
+            perror("Could not open the batch file");
+            return 1;
+        }
+    }
+
+    while (getline(&line, &size, file) != -1) {
+        ++lineno;
+
+        data = notif_create_data();
+        if (data == NULL) {
+            fprintf(errout, "Line %i: Out Of Memory!\n", lineno);
+            ret = 1;
+            continue;
+        }
+        parsed = parse_record(line, data);
+
+        if (parsed == PARSE_EMPTY) {
+            notif_free_data(data);
+            continue;
+        }
+
+        if (parsed != PARSE_OK) {
+            fprintf(errout, "Line %i: invalid record\n", lineno);
+            ret = 1;
+        }
+        else if (opts->no_wait) {
+            if (send_data(data, opts, &id) != 0)
+                ret = 1;
+        }
+        else if (notif_queue_notification(data, batch_sent, &ret) == 0) {
+            continue;
+        }
+        else {
+            fprintf(errout, "Error: %s\n", notif_get_error_message());
+            notif_free_error_message();
+            ret = 1;
+        }
+
+        notif_free_data(data);
+    }
+
+    notif_flush_queue();
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+
+    return ret;
 }
 
 int main(int argc, char **argv)
 {
     struct NotifyData *data;
-    int opt, urgency;
-
-    static struct option options[] = {
-        { "help", no_argument, 0, 'h' },
-        { "version", no_argument, 0, 'v' },
-        { "replaces-id", required_argument, 0, 'r' },
-        { "urgency", required_argument, 0, 'u' },
-        { "expire", required_argument, 0, 't' },
-        { "app-name", required_argument, 0, 'a' },
-        { "id-file", required_argument, 0, 'R' },
-        { "icon", required_argument, 0, 'i' },
-        { "category", required_argument, 0, 'c' },
-        { 0, 0, 0, 0 }
+    /* fields not named here start zeroed (false, NULL, 0) */
+    struct Options opts = {
+        .window = NOTIF_DEFAULT_WINDOW,
+        .timeout = -1,
+        .trace = TRACE_OFF,
+        .aggregate_by = AGGREGATE_BY_TAG,
     };
+    double startup, start, parse;
+    char key[IDSTORE_KEY_SIZE];
+    const char *tag;
+    bool cached;
+    int id, ret;
+
+    startup = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+    start = clock_ms(CLOCK_MONOTONIC);
+
+    errout = stdout;
 
     if (argc < 1) {
         show_help();
         return 1;
     }
 
+    /* strings of the command line notification point into argv */
     data = notif_create_data();
+    if (data == NULL) {
+        fprintf(errout, "Error: Out Of Memory!\n");
+        return 1;
+    }
+    notif_borrow_strings(data, true);
 
-    /* options */
-    while ((opt = getopt_long(argc, argv,"hvr:R:u:t:a:i:c:", options, NULL )) != -1) {
-        switch (opt) {
-        case 'h' :
-            show_help();
-            notif_free_data(data);
-            return 0;
+    ret = parse_arguments(argc, argv, data, &opts);
+    parse = clock_ms(CLOCK_MONOTONIC) - start;
+    if (ret == PARSE_EXIT) {
+        notif_free_data(data);
+        return 0;
+    }
+    if (ret == PARSE_ERROR)
+        goto error;
 
-        case 'v':
-            show_version();
-            notif_free_data(data);
-            return 0;
-
-        case 'r':
-            if (notif_get_id_file(data) != stdout) {
-                printf("-r and -R are incompatible options\n");
-                goto error;
-            }
-            notif_set_replaces_id(data, atoi(optarg));
-            break;
+    if (opts.retries > 0)
+        srand((unsigned int) time(NULL) ^ (unsigned int) getpid());
 
-        case 'R': {
-            if (notif_get_replaces_id(data) != 0) {
-                printf("-r and -R are incompatible options\n");
-                goto error;
-            }
-            FILE *file = fopen(optarg, "r+");
-            if (file == NULL) {
-                perror("Could not open the id_file");
-                goto error;
-            }
-            notif_set_id_file(data, file);
-            notif_set_replaces_id_from_file(data);
-            break;
-        }
-        case 'u':
-            urgency = parse_urgency(optarg);
-            if (urgency == NOTIF_ERROR) {
-                printf("Invalid urgency value!\n");
-                goto error;
-            }
-            notif_set_urgency(data, urgency);
-            break;
+    notif_set_window_size(opts.window);
+    notif_set_reply_timeout(opts.timeout);
+    notif_set_private_connection(true);
+    if (opts.trace != TRACE_OFF)
+        notif_set_trace(&trace);
 
-        case 't':
-            notif_set_expire_time(data, atoi(optarg));
-            break;
+    /* every invocation adds to the shared metrics */
+    metrics = metrics_open();
+    notif_set_metrics(metrics);
+    metrics_file = opts.metrics_file;
 
-        case 'a':
-            notif_set_app_name(data, optarg);
-            break;
+    if (opts.metrics && !opts.daemon) {
+        notif_free_data(data);
+        ret = print_metrics();
+        goto out;
+    }
 
-        case 'i':
-            notif_set_icon(data, optarg);
-            break;
+    if (opts.server_info) {
+        notif_free_data(data);
+        ret = print_server_info();
+        notif_close_connection();
+        goto out;
+    }
 
-        case 'c':
-            notif_set_category(data, optarg);
-            break;
+    if (opts.daemon) {
+        notif_free_data(data);
+        errout = stderr;
+        if (opts.metrics && metrics_file == NULL) {
+            fprintf(errout, "--daemon needs --metrics=FILE\n");
+            ret = 1;
+            goto out;
+        }
+        load_server_info(NULL);
+        ret = daemon_run(handle_request, opts.metrics ? export_metrics : NULL,
+                         METRICS_EXPORT_INTERVAL);
+        notif_close_connection();
+        goto out;
+    }
 
-        default:
-            printf("Usage:\nnotify-desktop [OPTION...] <SUMMARY> [BODY] - create a notification\n");
+    if (opts.batch || opts.coalesce > 0 || opts.aggregate > 0 || opts.priority > 0) {
+        if (notif_get_summary(data) != NULL || notif_get_replaces_id(data) != 0 ||
+            notif_get_id_file(data) != stdout || opts.id_key != NULL || opts.wait ||
+            opts.close_tag != NULL) {
+            printf("Notifications are read from input, not from the command line\n");
             goto error;
         }
+        notif_free_data(data);
+        errout = stderr;
+        load_server_info(NULL);
+        if (opts.priority > 0)
+            ret = priority_run(opts.priority);
+        else if (opts.aggregate > 0)
+            ret = aggregate_run(opts.aggregate, opts.aggregate_by);
+        else if (opts.coalesce > 0)
+            ret = coalesce_run(opts.coalesce);
+        else
+            ret = run_batch(&opts);
+        if (ret == 0)
+            refresh_server_info();
+        notif_close_connection();
+        goto out;
     }
 
-    /* summary + body */
-    for (; optind < argc; ++optind) {
-        if (notif_get_summary(data) == NULL) {
-            notif_set_summary(data, argv[optind]);
-        }
-        else if (notif_get_body(data) == NULL) {
-            notif_set_body(data, argv[optind]);
+    if (opts.match_count > 0 && opts.follow_count == 0) {
+        fprintf(errout, "--match needs --follow\n");
+        goto error;
+    }
+
+    if (opts.follow_count > 0) {
+        if (opts.id_key != NULL || opts.wait || opts.close_tag != NULL || opts.no_wait) {
+            fprintf(errout, "--follow cannot be used with --id-key, --wait, --close-tag or --no-wait\n");
+            goto error;
         }
-        else {
-            printf("Too many arguments!\n");
+        if (!notif_validate_data(data)) {
+            fprintf(errout, "--follow needs a SUMMARY\n");
             goto error;
         }
+        load_server_info(NULL);
+        ret = follow_run(data, opts.follow, opts.follow_count, opts.match, opts.match_count);
+        notif_close_connection();
+        notif_free_data(data);
+        goto out;
     }
 
     /* notif_print_data(data); */
 
-    if (notif_validate_data(data)) {
-        int id;
-        id = notif_send_notification(data);
+    if (opts.close_tag != NULL && (ret = close_group(&opts)) != 0)
+        goto failed;
 
-        if (id == -1) {
-            printf("Error: %s\n", notif_get_error_message());
-            notif_free_error_message();
+    if (notif_validate_data(data)) {
+        if (opts.wait && opts.no_wait) {
+            fprintf(errout, "--wait cannot be used with --no-wait\n");
             goto error;
         }
-        else {
-            fprintf(notif_get_id_file(data), "%i\n", id);
+        /* subscribe first, so no signal is sent before the match exists */
+        if (opts.wait && notif_watch_events() != 0) {
+            ret = library_error();
+            goto failed;
         }
+
+        cached = load_server_info(data);
+
+        /* tags are indexed unless the ID to replace is given */
+        tag = notif_get_tag(data);
+        if (opts.id_key != NULL)
+            ret = send_keyed(data, &opts, opts.id_key, &id);
+        else if (tag != NULL && notif_get_replaces_id(data) == 0 &&
+                 notif_get_id_file(data) == stdout && !opts.no_wait)
+            ret = tag_key(key, tag) ? send_keyed(data, &opts, key, &id) : 1;
+        else
+            ret = send_data(data, &opts, &id);
+        if (ret == 0 && cached)
+            refresh_server_info();
+        if (ret == 0 && opts.wait) {
+            fflush(notif_get_id_file(data));
+            ret = wait_event(id);
+        }
+        if (ret != 0)
+            goto failed;
     }
 
+    notif_close_connection();
     notif_free_data(data);
-    return 0;
+    ret = 0;
+    goto out;
 
 error:
+    ret = 1;
+
+failed:
     notif_free_data(data);
-    return 1;
+
+out:
+    notif_set_metrics(NULL);
+    metrics_close(metrics);
+    if (opts.trace != TRACE_OFF)
+        print_trace(opts.trace, startup, parse, clock_ms(CLOCK_MONOTONIC) - start);
+    return ret;
 }
@@ -0,0 +1,227 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+
+/*
+ * Metrics store: one struct NotifyMetrics behind a small header in a
+ * memory-mapped file shared by all notify-desktop invocations. The
+ * library adds to its counters atomically, so invocations never wait
+ * for each other. Only creating the file takes flock().
+ *
+ * Export reads the counters without a lock, a histogram may then be
+ * off by the observations made meanwhile.
+ */
+
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define METRICS_MAGIC "NDMET2"
+
+struct MetricsHeader {
+    char magic[8];
+    uint32_t size;
+    char reserved[52];
+};
+
+static const char *error_kinds[] = { NULL, "other", "timeout", "no_server", "no_bus" };
+
+static bool store_path(char *path, size_t size)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int len;
+
+    if (runtime == NULL || runtime[0] == '\0')
+        return false;
+
+    len = snprintf(path, size, "%s/notify-desktop", runtime);
+    if (len < 0 || (size_t) len >= size)
+        return false;
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return false;
+
+    len = snprintf(path, size, "%s/notify-desktop/metrics", runtime);
+    return len > 0 && (size_t) len < size;
+}
+
+/* New files are sized and given a header under the file lock */
+static bool init_file(int fd, size_t size)
+{
+    struct MetricsHeader header;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return false;
+    if (st.st_size != 0)
+        return (size_t) st.st_size == size;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, METRICS_MAGIC, sizeof(METRICS_MAGIC));
+    header.size = sizeof(struct NotifyMetrics);
+
+    return ftruncate(fd, size) == 0 &&
+           pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header);
+}
+
+struct NotifyMetrics *metrics_open(void)
+{
+    char path[4096];
+    struct MetricsHeader *header;
+    size_t size;
+    void *map;
+    int fd;
+    bool ok;
+
+    if (!store_path(path, sizeof(path)))
+        return NULL;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+
+    size = sizeof(struct MetricsHeader) + sizeof(struct NotifyMetrics);
+
+    flock(fd, LOCK_EX);
+    ok = init_file(fd, size);
+    flock(fd, LOCK_UN);
+
+    /* the mapping stays valid after close */
+    map = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    header = (struct MetricsHeader*) map;
+    if (memcmp(header->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) != 0 ||
+        header->size != sizeof(struct NotifyMetrics)) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    return (struct NotifyMetrics*) (header + 1);
+}
+
+void metrics_close(struct NotifyMetrics *metrics)
+{
+    if (metrics == NULL)
+        return;
+
+    munmap((struct MetricsHeader*) metrics - 1,
+           sizeof(struct MetricsHeader) + sizeof(struct NotifyMetrics));
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void write_counter(FILE *file, const char *name, const char *help, uint64_t value)
+{
+    fprintf(file, "# HELP notify_desktop_%s %s\n", name, help);
+    fprintf(file, "# TYPE notify_desktop_%s counter\n", name);
+    fprintf(file, "notify_desktop_%s %llu\n", name, (unsigned long long) value);
+}
+
+/* Buckets are stored apart, Prometheus wants them cumulative */
+static void write_histogram(FILE *file, const char *name, const char *help,
+                            const struct NotifyHistogram *histogram)
+{
+    static const uint64_t bounds[] = NOTIF_METRICS_BOUNDS;
+    uint64_t total = 0;
+    int i;
+
+    fprintf(file, "# HELP notify_desktop_%s_seconds %s\n", name, help);
+    fprintf(file, "# TYPE notify_desktop_%s_seconds histogram\n", name);
+    for (i = 0; i < NOTIF_METRICS_BUCKETS - 1; ++i) {
+        total += load(&histogram->buckets[i]);
+        fprintf(file, "notify_desktop_%s_seconds_bucket{le=\"%g\"} %llu\n",
+                name, bounds[i] / 1e6, (unsigned long long) total);
+    }
+    total += load(&histogram->buckets[i]);
+    fprintf(file, "notify_desktop_%s_seconds_bucket{le=\"+Inf\"} %llu\n",
+            name, (unsigned long long) total);
+    fprintf(file, "notify_desktop_%s_seconds_sum %.6f\n", name, load(&histogram->sum_us) / 1e6);
+    fprintf(file, "notify_desktop_%s_seconds_count %llu\n", name, (unsigned long long) total);
+}
+
+static void write_metrics(FILE *file, const struct NotifyMetrics *metrics)
+{
+    int kind;
+
+    write_counter(file, "notifications_total", "Notifications accepted by the server.",
+                  load(&metrics->sent));
+    write_counter(file, "notifications_posted_total",
+                  "Notifications written without waiting for a reply (--no-wait).",
+                  load(&metrics->posted));
+
+    fprintf(file, "# HELP notify_desktop_errors_total Failed sends by kind.\n");
+    fprintf(file, "# TYPE notify_desktop_errors_total counter\n");
+    for (kind = NOTIF_ERROR_OTHER; kind <= NOTIF_ERROR_NO_BUS; ++kind)
+        fprintf(file, "notify_desktop_errors_total{kind=\"%s\"} %llu\n",
+                error_kinds[kind], (unsigned long long) load(&metrics->errors[kind]));
+
+    write_counter(file, "connects_total", "Connections made to the session bus.",
+                  load(&metrics->connects));
+    write_counter(file, "reconnects_total", "Connections made again after losing the bus.",
+                  load(&metrics->reconnects));
+
+    write_histogram(file, "connect", "Time to connect to the session bus.", &metrics->connect);
+    write_histogram(file, "marshal", "Time to build a Notify call.", &metrics->marshal);
+    write_histogram(file, "round_trip", "Time from writing a Notify call to its reply.",
+                    &metrics->round_trip);
+}
+
+int metrics_export(const struct NotifyMetrics *metrics, const char *path)
+{
+    char tmp[4096];
+    FILE *file;
+    bool ok;
+
+    if (path == NULL) {
+        write_metrics(stdout, metrics);
+        return fflush(stdout) == 0 ? 0 : -1;
+    }
+
+    /* scrapers reading the file never see it half written */
+    snprintf(tmp, sizeof(tmp), "%s.%i", path, (int) getpid());
+    file = fopen(tmp, "w");
+    if (file == NULL) {
+        perror("Could not write the metrics");
+        return -1;
+    }
+
+    write_metrics(file, metrics);
+    ok = fclose(file) == 0;
+
+    if (ok && rename(tmp, path) == 0)
+        return 0;
+
+    perror("Could not write the metrics");
+    unlink(tmp);
+    return -1;
+}
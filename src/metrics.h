@@ -0,0 +1,42 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "notif.h"
+
+#define METRICS_EXPORT_INTERVAL 10000
+
+/*
+ * Maps the metrics kept in $XDG_RUNTIME_DIR/notify-desktop/metrics,
+ * which every invocation adds to. Returns NULL quietly when there is
+ * no usable file, the invocation then keeps no metrics.
+ */
+struct NotifyMetrics *metrics_open(void);
+void metrics_close(struct NotifyMetrics *metrics);
+
+/*
+ * Writes metrics in Prometheus text format to stdout when path is
+ * NULL, otherwise replaces the file at path. Prints error and returns
+ * -1 on failure.
+ */
+int metrics_export(const struct NotifyMetrics *metrics, const char *path);
+
+#endif /* METRICS_H */
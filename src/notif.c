@@ -20,27 +20,46 @@
 #include "dbusimp.h"
 
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#define NOTIF_ARENA_SIZE 256
+
+/*
+ * Strings are copied into one arena owned by data, or only pointed to
+ * when borrowing. The arena is kept by notif_reset_data(), so reused
+ * data stops allocating once the arena is large enough.
+ */
 struct NotifyData {
     unsigned int replaces_id;
     unsigned char urgency;
     int expire_time;
     FILE *id_file;
 
-    char *app_name;
-    char *icon;
-    char *category;
-    char *summary;
-    char *body;
+    const char *app_name;
+    const char *icon;
+    const char *category;
+    const char *summary;
+    const char *body;
+    const char *tag;
+    const char *actions[2 * NOTIF_MAX_ACTIONS];
+    unsigned int action_count;
+    struct NotifyHint hints[NOTIF_MAX_HINTS];
+    unsigned int hint_count;
+    const char *image_path;
+    int image_width;
+    int image_height;
+
+    bool borrow;
+    bool oom;
+    char *arena;
+    size_t arena_len;
+    size_t arena_size;
 };
 
-struct NotifyData *notif_create_data(void)
+static void clear_data(struct NotifyData *data)
 {
-    struct NotifyData *data;
-    data = (struct NotifyData*) malloc(sizeof(struct NotifyData));
-
     data->replaces_id = 0;
     data->urgency = NOTIF_URGENCY_NORMAL;
     data->expire_time = -1;
@@ -50,24 +69,124 @@ struct NotifyData *notif_create_data(void)
     data->category = NULL;
     data->summary = NULL;
     data->body = NULL;
+    data->tag = NULL;
+    data->action_count = 0;
+    data->hint_count = 0;
+    data->image_path = NULL;
+    data->oom = false;
+    data->image_width = 0;
+    data->image_height = 0;
+    data->arena_len = 0;
+}
+
+static void rebase_string(const char **field, uintptr_t old, size_t len, char *arena)
+{
+    uintptr_t p = (uintptr_t) *field;
+
+    if (*field != NULL && p >= old && p < old + len)
+        *field = arena + (p - old);
+}
+
+/* Moves string pointers into the arena that was at old to arena */
+static void rebase_strings(struct NotifyData *data, uintptr_t old, char *arena)
+{
+    size_t len = data->arena_len;
+    unsigned int i;
+
+    rebase_string(&data->app_name, old, len, arena);
+    rebase_string(&data->icon, old, len, arena);
+    rebase_string(&data->category, old, len, arena);
+    rebase_string(&data->summary, old, len, arena);
+    rebase_string(&data->body, old, len, arena);
+    rebase_string(&data->tag, old, len, arena);
+    rebase_string(&data->image_path, old, len, arena);
+
+    for (i = 0; i < 2 * data->action_count; ++i)
+        rebase_string(&data->actions[i], old, len, arena);
+
+    for (i = 0; i < data->hint_count; ++i) {
+        rebase_string(&data->hints[i].name, old, len, arena);
+        if (data->hints[i].type == 's')
+            rebase_string(&data->hints[i].value.s, old, len, arena);
+    }
+}
+
+static const char *store_string(struct NotifyData *data, const char *string)
+{
+    uintptr_t old = (uintptr_t) data->arena;
+    uintptr_t p = (uintptr_t) string;
+    bool own = data->arena != NULL && p >= old && p < old + data->arena_len;
+    size_t len, size;
+    char *arena;
+
+    if (data->borrow)
+        return string;
+
+    len = strlen(string) + 1;
+    if (data->arena_len + len > data->arena_size) {
+        size = data->arena_size ? data->arena_size : NOTIF_ARENA_SIZE;
+        while (size < data->arena_len + len)
+            size *= 2;
+
+        /* the string is dropped and sending data fails */
+        arena = (char*) realloc(data->arena, size);
+        if (arena == NULL) {
+            data->oom = true;
+            return NULL;
+        }
+        rebase_strings(data, old, arena);
+
+        /* string may be one of our own */
+        if (own)
+            string = arena + (p - old);
+
+        data->arena = arena;
+        data->arena_size = size;
+    }
+
+    arena = data->arena + data->arena_len;
+    memcpy(arena, string, len);
+    data->arena_len += len;
+    return arena;
+}
+
+struct NotifyData *notif_create_data(void)
+{
+    struct NotifyData *data;
+    data = (struct NotifyData*) malloc(sizeof(struct NotifyData));
+    if (data == NULL)
+        return NULL;
+
+    clear_data(data);
+    data->borrow = false;
+    data->arena = NULL;
+    data->arena_size = 0;
 
     return data;
 }
 
+void notif_reset_data(struct NotifyData *data)
+{
+    if (data->id_file != NULL && data->id_file != stdout)
+        fclose(data->id_file);
+
+    clear_data(data);
+}
+
+void notif_borrow_strings(struct NotifyData *data, bool borrow)
+{
+    data->borrow = borrow;
+}
+
 void notif_free_data(struct NotifyData *data)
 {
     if (data == NULL)
         return;
 
-    if (data->id_file != NULL)
+    if (data->id_file != NULL && data->id_file != stdout)
         fclose(data->id_file);
 
-    free(data->app_name);
-    free(data->icon);
-    free(data->category);
-    free(data->summary);
-    free(data->body);
-
+    free(data->arena);
     free(data);
 }
 
@@ -76,19 +195,20 @@ void notif_set_replaces_id(struct NotifyData *data, unsigned int id)
     data->replaces_id = id;
 }
 
-void notif_set_replaces_id_from_file(struct NotifyData *data)
+int notif_set_replaces_id_from_file(struct NotifyData *data)
 {
     size_t arr_length=0;
     char* lineptr = NULL;
     if (getline(&lineptr, &arr_length, data->id_file) == -1 ) {
         if (!feof(data->id_file)) {
-            perror("Could not read from file");
-            exit(EXIT_FAILURE);
+            free(lineptr);
+            return -1;
         }
     }
-    data->replaces_id = atoi(lineptr);
+    data->replaces_id = lineptr != NULL ? atoi(lineptr) : 0;
     rewind(data->id_file);
     free(lineptr);
+    return 0;
 }
 
 void notif_set_urgency(struct NotifyData *data, unsigned char urgency)
@@ -103,12 +223,12 @@ void notif_set_expire_time(struct NotifyData *data, int time)
 
 void notif_set_app_name(struct NotifyData *data, const char *name)
 {
-    data->app_name = strdup(name);
+    data->app_name = store_string(data, name);
 }
 
 void notif_set_icon(struct NotifyData *data, const char *icon)
 {
-    data->icon = strdup(icon);
+    data->icon = store_string(data, icon);
 }
 
 void notif_set_id_file(struct NotifyData *data, FILE *file)
@@ -118,17 +238,64 @@ void notif_set_id_file(struct NotifyData *data, FILE *file)
 
 void notif_set_category(struct NotifyData *data, const char *category)
 {
-    data->category = strdup(category);
+    data->category = store_string(data, category);
 }
 
 void notif_set_summary(struct NotifyData *data, const char *summary)
 {
-    data->summary = strdup(summary);
+    data->summary = store_string(data, summary);
 }
 
 void notif_set_body(struct NotifyData *data, const char *body)
 {
-    data->body = strdup(body);
+    data->body = store_string(data, body);
+}
+
+void notif_set_tag(struct NotifyData *data, const char *tag)
+{
+    data->tag = store_string(data, tag);
+}
+
+bool notif_add_hint(struct NotifyData *data, const struct NotifyHint *hint)
+{
+    struct NotifyHint *h = &data->hints[data->hint_count];
+
+    if (data->hint_count == NOTIF_MAX_HINTS)
+        return false;
+
+    /* counted first, so the name is rebased when storing the value moves it */
+    *h = *hint;
+    h->name = NULL;
+    if (h->type == 's')
+        h->value.s = NULL;
+    ++data->hint_count;
+
+    h->name = store_string(data, hint->name);
+    if (h->type == 's')
+        h->value.s = store_string(data, hint->value.s);
+    return true;
+}
+
+bool notif_add_action(struct NotifyData *data, const char *key, const char *label)
+{
+    unsigned int i = 2 * data->action_count;
+
+    if (data->action_count == NOTIF_MAX_ACTIONS)
+        return false;
+
+    /* count first, so the key is rebased when storing label moves it */
+    data->actions[i + 1] = NULL;
+    data->actions[i] = store_string(data, key);
+    ++data->action_count;
+    data->actions[i + 1] = store_string(data, label);
+    return true;
+}
+
+void notif_set_image_data(struct NotifyData *data, const char *path, int width, int height)
+{
+    data->image_path = store_string(data, path);
+    data->image_width = width;
+    data->image_height = height;
 }
 
 unsigned int notif_get_replaces_id(struct NotifyData *data)
@@ -176,34 +343,72 @@ const char *notif_get_body(struct NotifyData *data)
     return data->body;
 }
 
+const char *notif_get_tag(struct NotifyData *data)
+{
+    return data->tag;
+}
+
+const char *notif_get_image_path(struct NotifyData *data)
+{
+    return data->image_path;
+}
+
+int notif_get_image_width(struct NotifyData *data)
+{
+    return data->image_width;
+}
+
+int notif_get_image_height(struct NotifyData *data)
+{
+    return data->image_height;
+}
+
+unsigned int notif_get_hint_count(struct NotifyData *data)
+{
+    return data->hint_count;
+}
+
+const struct NotifyHint *notif_get_hint(struct NotifyData *data, unsigned int i)
+{
+    return &data->hints[i];
+}
+
+unsigned int notif_get_action_count(struct NotifyData *data)
+{
+    return data->action_count;
+}
+
+const char *notif_get_action_key(struct NotifyData *data, unsigned int i)
+{
+    return data->actions[2 * i];
+}
+
+const char *notif_get_action_label(struct NotifyData *data, unsigned int i)
+{
+    return data->actions[2 * i + 1];
+}
+
 bool notif_validate_data(struct NotifyData *data)
 {
     if (data == NULL)
         return false;
 
-    if (data->summary == NULL)
+    /* a summary dropped when out of memory fails the send with that error */
+    if (data->summary == NULL && !data->oom)
         return false;
 
-    /* allocate all empty strings with null string */
-    if (data->app_name == NULL) {
-        data->app_name = (char*) malloc(sizeof(char));
-        data->app_name[0] = '\0';
-    }
+    /* missing strings are sent empty */
+    if (data->app_name == NULL)
+        data->app_name = "";
 
-    if (data->icon == NULL) {
-        data->icon = (char*) malloc(sizeof(char));
-        data->icon[0] = '\0';
-    }
+    if (data->icon == NULL)
+        data->icon = "";
 
-    if (data->category == NULL) {
-        data->category = (char*) malloc(sizeof(char));
-        data->category[0] = '\0';
-    }
+    if (data->category == NULL)
+        data->category = "";
 
-    if (data->body == NULL) {
-        data->body = (char*) malloc(sizeof(char));
-        data->body[0] = '\0';
-    }
+    if (data->body == NULL)
+        data->body = "";
 
     return true;
 }
@@ -229,18 +434,515 @@ void notif_print_data(struct NotifyData *data)
            data->body);
 }
 
+struct NotifyContext *notif_context_create(void)
+{
+    return _notif_create_context();
+}
+
+void notif_context_free(struct NotifyContext *ctx)
+{
+    _notif_free_context(ctx);
+}
+
+void notif_context_set_private_connection(struct NotifyContext *ctx, bool private_conn)
+{
+    _notif_set_private_connection(ctx, private_conn);
+}
+
+void notif_context_set_window_size(struct NotifyContext *ctx, unsigned int size)
+{
+    _notif_set_window_size(ctx, size);
+}
+
+void notif_context_set_reply_timeout(struct NotifyContext *ctx, int timeout)
+{
+    _notif_set_reply_timeout(ctx, timeout);
+}
+
+void notif_context_set_trace(struct NotifyContext *ctx, struct NotifyTrace *trace)
+{
+    _notif_set_trace(ctx, trace);
+}
+
+void notif_context_set_metrics(struct NotifyContext *ctx, struct NotifyMetrics *metrics)
+{
+    _notif_set_metrics(ctx, metrics);
+}
+
+void notif_context_close(struct NotifyContext *ctx)
+{
+    _notif_close_connection(ctx);
+}
+
+struct NotifyStatus notif_context_send(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    struct NotifyStatus status;
+
+    status.id = _notif_send_notification(ctx, data);
+    status.error = status.id == -1 ? _notif_get_error_message(ctx) : NULL;
+    status.error_kind = status.id == -1 ? _notif_get_error_kind(ctx) : 0;
+    return status;
+}
+
+struct NotifyStatus notif_context_post(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    struct NotifyStatus status;
+
+    status.id = _notif_post_notification(ctx, data);
+    status.error = status.id == -1 ? _notif_get_error_message(ctx) : NULL;
+    status.error_kind = status.id == -1 ? _notif_get_error_kind(ctx) : 0;
+    return status;
+}
+
+int notif_context_close_notifications(struct NotifyContext *ctx, const unsigned int *ids,
+                                      unsigned int count)
+{
+    return _notif_close_notifications(ctx, ids, count);
+}
+
+int notif_context_queue(struct NotifyContext *ctx, struct NotifyData *data,
+                        NotifyCallback callback, void *user_data)
+{
+    return _notif_queue_notification(ctx, data, callback, user_data);
+}
+
+void notif_context_flush(struct NotifyContext *ctx)
+{
+    _notif_flush_queue(ctx);
+}
+
+const char *notif_context_get_error_message(struct NotifyContext *ctx)
+{
+    return _notif_get_error_message(ctx);
+}
+
+int notif_context_get_error_kind(struct NotifyContext *ctx)
+{
+    return _notif_get_error_kind(ctx);
+}
+
+int notif_context_get_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info)
+{
+    return _notif_get_server_info(ctx, info);
+}
+
+void notif_context_set_server_info(struct NotifyContext *ctx, const struct NotifyServerInfo *info)
+{
+    _notif_set_server_info(ctx, info);
+}
+
+bool notif_context_has_server_info(struct NotifyContext *ctx)
+{
+    return _notif_has_server_info(ctx);
+}
+
+int notif_context_watch_events(struct NotifyContext *ctx)
+{
+    return _notif_watch_events(ctx);
+}
+
+int notif_context_wait_event(struct NotifyContext *ctx, unsigned int id,
+                             struct NotifyEvent *event, int timeout)
+{
+    return _notif_wait_event(ctx, id, event, timeout);
+}
+
+/*
+ * Functions without context use a default one, created on first use.
+ * It keeps the shared connection by default, as before contexts.
+ * When it cannot be created, calls fail with _notif_default_error.
+ */
+static struct NotifyContext *_notif_default = NULL;
+static const char *_notif_default_error = NULL;
+
+static struct NotifyContext *default_context(void)
+{
+    if (NULL == _notif_default) {
+        _notif_default = _notif_create_context();
+        if (NULL == _notif_default) {
+            _notif_default_error = "Out Of Memory!";
+            return NULL;
+        }
+        _notif_set_private_connection(_notif_default, false);
+    }
+    return _notif_default;
+}
+
+void notif_set_private_connection(bool private_conn)
+{
+    if (default_context() != NULL)
+        _notif_set_private_connection(_notif_default, private_conn);
+}
+
+void notif_set_trace(struct NotifyTrace *trace)
+{
+    if (default_context() != NULL)
+        _notif_set_trace(_notif_default, trace);
+}
+
+void notif_set_metrics(struct NotifyMetrics *metrics)
+{
+    if (default_context() != NULL)
+        _notif_set_metrics(_notif_default, metrics);
+}
+
+void notif_close_connection(void)
+{
+    if (_notif_default != NULL)
+        _notif_close_connection(_notif_default);
+}
+
 int notif_send_notification(struct NotifyData *data)
 {
-    return _notif_send_notification(data);
+    if (default_context() == NULL)
+        return -1;
+    return _notif_send_notification(_notif_default, data);
+}
+
+int notif_post_notification(struct NotifyData *data)
+{
+    if (default_context() == NULL)
+        return -1;
+    return _notif_post_notification(_notif_default, data);
+}
+
+int notif_close_notifications(const unsigned int *ids, unsigned int count)
+{
+    if (default_context() == NULL)
+        return -1;
+    return _notif_close_notifications(_notif_default, ids, count);
+}
+
+void notif_set_window_size(unsigned int size)
+{
+    if (default_context() != NULL)
+        _notif_set_window_size(_notif_default, size);
+}
+
+void notif_set_reply_timeout(int timeout)
+{
+    if (default_context() != NULL)
+        _notif_set_reply_timeout(_notif_default, timeout);
+}
+
+int notif_queue_notification(struct NotifyData *data, NotifyCallback callback, void *user_data)
+{
+    if (default_context() == NULL)
+        return -1;
+    return _notif_queue_notification(_notif_default, data, callback, user_data);
+}
+
+void notif_flush_queue(void)
+{
+    if (_notif_default != NULL)
+        _notif_flush_queue(_notif_default);
 }
 
 const char *notif_get_error_message(void)
 {
-    return _notif_get_error_message();
+    return _notif_default != NULL ? _notif_get_error_message(_notif_default) : _notif_default_error;
+}
+
+int notif_get_error_kind(void)
+{
+    if (_notif_default == NULL)
+        return _notif_default_error != NULL ? NOTIF_ERROR_OTHER : 0;
+    return _notif_get_error_kind(_notif_default);
+}
+
+int _notif_error_name_kind(const char *name)
+{
+    static const char *timeouts[] = { "org.freedesktop.DBus.Error.NoReply",
+                                      "org.freedesktop.DBus.Error.Timeout",
+                                      "org.freedesktop.DBus.Error.TimedOut" };
+    static const char *servers[] = { "org.freedesktop.DBus.Error.ServiceUnknown",
+                                     "org.freedesktop.DBus.Error.NameHasNoOwner" };
+    unsigned int i;
+
+    if (name == NULL)
+        return NOTIF_ERROR_OTHER;
+
+    for (i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); ++i) {
+        if (strcmp(name, timeouts[i]) == 0)
+            return NOTIF_ERROR_TIMEOUT;
+    }
+    for (i = 0; i < sizeof(servers) / sizeof(servers[0]); ++i) {
+        if (strcmp(name, servers[i]) == 0)
+            return NOTIF_ERROR_NO_SERVER;
+    }
+    /* activation failures: Spawn.ExecFailed, Spawn.ServiceNotFound, ... */
+    if (strncmp(name, "org.freedesktop.DBus.Error.Spawn.", 33) == 0)
+        return NOTIF_ERROR_NO_SERVER;
+    if (strcmp(name, "org.freedesktop.DBus.Error.Disconnected") == 0)
+        return NOTIF_ERROR_NO_BUS;
+    return NOTIF_ERROR_OTHER;
 }
 
 void notif_free_error_message(void)
 {
-    _notif_free_error_message();
+    if (_notif_default != NULL)
+        _notif_free_error_message(_notif_default);
+    _notif_default_error = NULL;
 }
 
+int notif_get_server_info(struct NotifyServerInfo *info)
+{
+    if (default_context() == NULL)
+        return -1;
+    return _notif_get_server_info(_notif_default, info);
+}
+
+void notif_set_server_info(const struct NotifyServerInfo *info)
+{
+    if (default_context() != NULL)
+        _notif_set_server_info(_notif_default, info);
+}
+
+bool notif_has_server_info(void)
+{
+    return _notif_default != NULL && _notif_has_server_info(_notif_default);
+}
+
+unsigned int notif_capability(const char *name)
+{
+    static const char *names[] = {
+        "actions", "body", "body-hyperlinks", "body-images", "body-markup",
+        "icon-multi", "icon-static", "persistence", "sound"
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strcmp(name, names[i]) == 0)
+            return 1u << i;
+    }
+    return 0;
+}
+
+unsigned int _notif_server_capabilities(const struct ServerCache *cache)
+{
+    return cache->valid ? cache->info.capabilities : ~0u;
+}
+
+bool _notif_server_seen(struct ServerCache *cache, const char *owner)
+{
+    if (!cache->valid || owner == NULL || strcmp(cache->info.owner, owner) == 0)
+        return false;
+
+    cache->valid = false;
+    return true;
+}
+
+bool _notif_hint_supported(unsigned int capabilities, const char *name)
+{
+    if (strcmp(name, "sound-file") == 0 || strcmp(name, "sound-name") == 0 ||
+        strcmp(name, "suppress-sound") == 0)
+        return capabilities & NOTIF_CAP_SOUND;
+
+    return true;
+}
+
+size_t _notif_strip_markup(char *out, const char *in)
+{
+    static const char *entities[] = { "&lt;", "<", "&gt;", ">", "&amp;", "&", "&quot;", "\"", "&apos;", "'" };
+    char *start = out;
+    size_t i, len;
+
+    while (*in != '\0') {
+        if (*in == '<') {
+            /* an unterminated tag is kept as text */
+            len = strcspn(in, ">");
+            if (in[len] == '>') {
+                in += len + 1;
+                continue;
+            }
+        }
+        else if (*in == '&') {
+            for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i += 2) {
+                len = strlen(entities[i]);
+                if (strncmp(in, entities[i], len) == 0)
+                    break;
+            }
+            if (i < sizeof(entities) / sizeof(entities[0])) {
+                *out++ = entities[i + 1][0];
+                in += len;
+                continue;
+            }
+        }
+        *out++ = *in++;
+    }
+
+    *out = '\0';
+    return out - start;
+}
+
+void _notif_copy_info(char *out, const char *in)
+{
+    snprintf(out, NOTIF_INFO_SIZE, "%s", in != NULL ? in : "");
+}
+
+/* Most strings are ASCII, they are checked a word at a time */
+static bool valid_utf8(const char *str)
+{
+    const unsigned char *s = (const unsigned char*) str;
+    const unsigned char *end;
+    uint64_t word;
+    size_t len, i;
+
+    if (s == NULL)
+        return true;
+
+    end = s + strlen(str);
+    while (s < end) {
+        /* ASCII runs are skipped 32 bytes at a time, then 8 */
+        while (end - s >= 32) {
+            uint64_t words[4];
+
+            memcpy(words, s, sizeof(words));
+            if ((words[0] | words[1] | words[2] | words[3]) & 0x8080808080808080ull)
+                break;
+            s += sizeof(words);
+        }
+        if (end - s >= 8) {
+            memcpy(&word, s, sizeof(word));
+            if (!(word & 0x8080808080808080ull)) {
+                s += sizeof(word);
+                continue;
+            }
+        }
+        if (*s < 0x80) {
+            ++s;
+            continue;
+        }
+
+        if (*s >= 0xc2 && *s <= 0xdf)
+            len = 2;
+        else if (*s >= 0xe0 && *s <= 0xef)
+            len = 3;
+        else if (*s >= 0xf0 && *s <= 0xf4)
+            len = 4;
+        else
+            return false;
+
+        if (len > (size_t) (end - s))
+            return false;
+        for (i = 1; i < len; ++i) {
+            if ((s[i] & 0xc0) != 0x80)
+                return false;
+        }
+
+        /* overlong forms, surrogates and code points above U+10FFFF */
+        if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] > 0x9f) ||
+            (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] > 0x8f))
+            return false;
+        s += len;
+    }
+    return true;
+}
+
+bool _notif_data_out_of_memory(struct NotifyData *data)
+{
+    return data->oom;
+}
+
+const char *_notif_invalid_string(struct NotifyData *data, bool fixed)
+{
+    unsigned int i;
+
+    if (!valid_utf8(data->summary))
+        return "summary";
+    if (!valid_utf8(data->body))
+        return "body";
+    for (i = 0; i < 2 * data->action_count; ++i) {
+        if (!valid_utf8(data->actions[i]))
+            return "action";
+    }
+
+    if (!fixed)
+        return NULL;
+
+    if (!valid_utf8(data->app_name))
+        return "app name";
+    if (!valid_utf8(data->icon))
+        return "icon";
+    if (!valid_utf8(data->category))
+        return "category";
+    for (i = 0; i < data->hint_count; ++i) {
+        if (!valid_utf8(data->hints[i].name) ||
+            (data->hints[i].type == 's' && !valid_utf8(data->hints[i].value.s)))
+            return "hint";
+    }
+    return NULL;
+}
+
+/* relaxed, the counters order nothing else */
+static void metrics_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void _notif_metrics_observe(struct NotifyMetrics *metrics, struct NotifyHistogram *histogram,
+                            double ms)
+{
+    static const uint64_t bounds[] = NOTIF_METRICS_BOUNDS;
+    uint64_t us;
+    unsigned int i;
+
+    if (metrics == NULL)
+        return;
+
+    us = ms > 0 ? (uint64_t) (ms * 1000.0) : 0;
+    for (i = 0; i < NOTIF_METRICS_BUCKETS - 1 && us > bounds[i]; ++i)
+        ;
+
+    metrics_add(&histogram->buckets[i], 1);
+    metrics_add(&histogram->sum_us, us);
+    metrics_add(&histogram->count, 1);
+}
+
+void _notif_metrics_connected(struct NotifyMetrics *metrics, double ms, bool reconnect)
+{
+    if (metrics == NULL)
+        return;
+
+    metrics_add(&metrics->connects, 1);
+    if (reconnect)
+        metrics_add(&metrics->reconnects, 1);
+    _notif_metrics_observe(metrics, &metrics->connect, ms);
+}
+
+void _notif_metrics_result(struct NotifyMetrics *metrics, int id, int kind)
+{
+    if (metrics == NULL)
+        return;
+
+    if (id == -1)
+        metrics_add(&metrics->errors[kind > 0 ? kind : NOTIF_ERROR_OTHER], 1);
+    else
+        metrics_add(&metrics->sent, 1);
+}
+
+/* Posted notifications are only written, the server may still reject them */
+void _notif_metrics_posted(struct NotifyMetrics *metrics, int ret, int kind)
+{
+    if (metrics == NULL)
+        return;
+
+    if (ret == -1)
+        metrics_add(&metrics->errors[kind > 0 ? kind : NOTIF_ERROR_OTHER], 1);
+    else
+        metrics_add(&metrics->posted, 1);
+}
+
+int notif_watch_events(void)
+{
+    if (default_context() == NULL)
+        return -1;
+    return _notif_watch_events(_notif_default);
+}
+
+int notif_wait_event(unsigned int id, struct NotifyEvent *event, int timeout)
+{
+    if (default_context() == NULL)
+        return -1;
+    return _notif_wait_event(_notif_default, id, event, timeout);
+}
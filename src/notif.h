@@ -21,6 +21,7 @@
 
 #include <stdbool.h>
 #define _POSIX_C_SOURCE 200809
+#include <stdint.h>
 #include <stdio.h>
 
 #define NOTIF_URGENCY_LOW 0
@@ -29,13 +30,167 @@
 
 #define NOTIF_ERROR -1
 
+/* kinds of failure, see notif_get_error_kind() */
+#define NOTIF_ERROR_OTHER 1
+#define NOTIF_ERROR_TIMEOUT 2
+#define NOTIF_ERROR_NO_SERVER 3
+#define NOTIF_ERROR_NO_BUS 4
+
+#define NOTIF_DEFAULT_WINDOW 16
+#define NOTIF_MAX_ACTIONS 8
+#define NOTIF_MAX_HINTS 16
+
+/* capabilities of the notification server */
+#define NOTIF_CAP_ACTIONS           (1u << 0)
+#define NOTIF_CAP_BODY              (1u << 1)
+#define NOTIF_CAP_BODY_HYPERLINKS   (1u << 2)
+#define NOTIF_CAP_BODY_IMAGES       (1u << 3)
+#define NOTIF_CAP_BODY_MARKUP       (1u << 4)
+#define NOTIF_CAP_ICON_MULTI        (1u << 5)
+#define NOTIF_CAP_ICON_STATIC       (1u << 6)
+#define NOTIF_CAP_PERSISTENCE       (1u << 7)
+#define NOTIF_CAP_SOUND             (1u << 8)
+
+#define NOTIF_INFO_SIZE 64
+
+#define NOTIF_EVENT_ACTION 1
+#define NOTIF_EVENT_CLOSED 2
+
+#define NOTIF_TRACE_CONNECT 0
+#define NOTIF_TRACE_MARSHAL 1
+#define NOTIF_TRACE_FLUSH 2
+#define NOTIF_TRACE_REPLY 3
+#define NOTIF_TRACE_PHASES 4
+
+/* upper bounds in microseconds of the histogram buckets, the last bucket has none */
+#define NOTIF_METRICS_BOUNDS { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, \
+                               100000, 250000, 1000000 }
+#define NOTIF_METRICS_BUCKETS 13
+
 typedef void NotifyData;
+struct NotifyData;
+
+/*
+ * Called once for every queued notification, in the order they were
+ * queued. id is -1 on failure, notif_get_error_message() (or
+ * notif_context_get_error_message() of the context) then holds the reason.
+ */
+typedef void (*NotifyCallback)(struct NotifyData *data, int id, void *user_data);
+
+/*
+ * Milliseconds spent in each phase of sending, summed over all
+ * notifications sent while the trace is set.
+ */
+struct NotifyTrace {
+    double phase[NOTIF_TRACE_PHASES];
+    unsigned int count;
+};
 
+/* Counts of observed durations per bucket (not cumulative) */
+struct NotifyHistogram {
+    uint64_t buckets[NOTIF_METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+};
+
+/*
+ * Counters kept while metrics are set. Unlike the trace every value
+ * is added atomically and the struct holds no pointers, so threads
+ * can share one and processes can share one in shared memory.
+ *
+ * sent counts notifications the server accepted, posted ones written
+ * without waiting for a reply, errors failed sends by NOTIF_ERROR_*
+ * kind. connect holds
+ * the time of establishing each connection, marshal of building each
+ * message, round_trip from writing a Notify call to its reply.
+ */
+struct NotifyMetrics {
+    uint64_t sent;
+    uint64_t posted;
+    uint64_t errors[NOTIF_ERROR_NO_BUS + 1];
+    uint64_t connects;
+    uint64_t reconnects;
+    struct NotifyHistogram connect;
+    struct NotifyHistogram marshal;
+    struct NotifyHistogram round_trip;
+};
+
+/*
+ * Result of a send. id is -1 on failure, error then holds the reason,
+ * valid until the next call on the same context, and error_kind its
+ * NOTIF_ERROR_* kind.
+ */
+struct NotifyStatus {
+    int id;
+    const char *error;
+    int error_kind;
+};
+
+/*
+ * Signal received for a sent notification. key is set for actions and
+ * valid until the next wait, reason is set for closed notifications
+ * (1 expired, 2 dismissed by user, 3 closed by call, 4 undefined).
+ */
+struct NotifyEvent {
+    int type;
+    unsigned int id;
+    const char *key;
+    unsigned int reason;
+};
+
+/*
+ * Hint sent in addition to category and urgency. type is the D-Bus
+ * type code of the value: 'i' int, 'd' double, 's' string, 'y' byte
+ * or 'b' boolean.
+ */
+struct NotifyHint {
+    const char *name;
+    char type;
+    union {
+        int i;
+        double d;
+        const char *s;
+        unsigned char y;
+        bool b;
+    } value;
+};
+
+/*
+ * GetServerInformation and GetCapabilities of the notification server,
+ * owner is its unique bus name. Strings are truncated to fit.
+ */
+struct NotifyServerInfo {
+    char owner[NOTIF_INFO_SIZE];
+    char name[NOTIF_INFO_SIZE];
+    char vendor[NOTIF_INFO_SIZE];
+    char version[NOTIF_INFO_SIZE];
+    char spec_version[NOTIF_INFO_SIZE];
+    unsigned int capabilities;
+};
+
+struct NotifyContext;
+
+/* Returns NULL when out of memory */
 struct NotifyData *notif_create_data(void);
 void notif_free_data(struct NotifyData *data);
 
+/*
+ * Resets data to the state of notif_create_data() for reuse. Memory
+ * for strings is kept, so reused data does not allocate per send.
+ */
+void notif_reset_data(struct NotifyData *data);
+
+/*
+ * Setters copy strings unless borrowing is enabled, then data only
+ * points to them and they must outlive data (for example argv). A
+ * string that cannot be copied is dropped, and sending data then
+ * fails with "Out Of Memory!".
+ */
+void notif_borrow_strings(struct NotifyData *data, bool borrow);
+
 void notif_set_replaces_id(struct NotifyData *data, unsigned int id);
-void notif_set_replaces_id_from_file(struct NotifyData *data);
+/* Reads the ID from the ID file, returns -1 with errno set when it cannot be read */
+int notif_set_replaces_id_from_file(struct NotifyData *data);
 void notif_set_urgency(struct NotifyData *data, unsigned char urgency);
 void notif_set_expire_time(struct NotifyData *data, int time);
 void notif_set_app_name(struct NotifyData *data, const char *name);
@@ -44,6 +199,20 @@ void notif_set_id_file(struct NotifyData *data, FILE *file);
 void notif_set_category(struct NotifyData *data, const char *category);
 void notif_set_summary(struct NotifyData *data, const char *summary);
 void notif_set_body(struct NotifyData *data, const char *body);
+void notif_set_tag(struct NotifyData *data, const char *tag);
+
+/*
+ * Sends the raw RGB or RGBA pixels in the file at path as image-data
+ * hint. The file is read when the notification is sent and its pixels
+ * are kept for following sends until it changes.
+ */
+void notif_set_image_data(struct NotifyData *data, const char *path, int width, int height);
+
+/* Returns false when data already has NOTIF_MAX_HINTS hints, strings are stored like all others */
+bool notif_add_hint(struct NotifyData *data, const struct NotifyHint *hint);
+
+/* Returns false when data already has NOTIF_MAX_ACTIONS actions */
+bool notif_add_action(struct NotifyData *data, const char *key, const char *label);
 
 unsigned int notif_get_replaces_id(struct NotifyData *data);
 unsigned char notif_get_urgency(struct NotifyData *data);
@@ -54,12 +223,145 @@ const char *notif_get_icon(struct NotifyData *data);
 const char *notif_get_category(struct NotifyData *data);
 const char *notif_get_summary(struct NotifyData *data);
 const char *notif_get_body(struct NotifyData *data);
+const char *notif_get_tag(struct NotifyData *data);
+const char *notif_get_image_path(struct NotifyData *data);
+int notif_get_image_width(struct NotifyData *data);
+int notif_get_image_height(struct NotifyData *data);
+unsigned int notif_get_hint_count(struct NotifyData *data);
+const struct NotifyHint *notif_get_hint(struct NotifyData *data, unsigned int i);
+unsigned int notif_get_action_count(struct NotifyData *data);
+const char *notif_get_action_key(struct NotifyData *data, unsigned int i);
+const char *notif_get_action_label(struct NotifyData *data, unsigned int i);
 
 bool notif_validate_data(struct NotifyData *data);
 void notif_print_data(struct NotifyData *data);
 
+/*
+ * Private connection is not shared with other users of libdbus in the
+ * process. Must be set before the first send.
+ */
+void notif_set_private_connection(bool private_conn);
+void notif_set_trace(struct NotifyTrace *trace);
+void notif_set_metrics(struct NotifyMetrics *metrics);
+void notif_close_connection(void);
+
 int notif_send_notification(struct NotifyData *data);
+
+/*
+ * Sends notification without waiting for the reply, returns 0 on success.
+ * Messages are written by notif_flush_queue(). Errors from the server,
+ * including missing notification server, cannot be detected.
+ */
+int notif_post_notification(struct NotifyData *data);
+
+/*
+ * Closes notifications with CloseNotification, all calls are sent
+ * before waiting for the first reply. Notifications that are already
+ * closed are not an error. Returns 0 on success, -1 on error.
+ */
+int notif_close_notifications(const unsigned int *ids, unsigned int count);
+
+void notif_set_window_size(unsigned int size);
+void notif_set_reply_timeout(int timeout);
+int notif_queue_notification(struct NotifyData *data, NotifyCallback callback, void *user_data);
+void notif_flush_queue(void);
 const char *notif_get_error_message(void);
 void notif_free_error_message(void);
 
+/*
+ * Tells why the call that set the error message failed: no reply
+ * within the reply timeout, no notification server on the bus (and
+ * none could be activated), no bus to connect to or the connection was
+ * lost, or anything else. 0 while there is no error message. Timeouts
+ * and missing servers or buses are worth retrying.
+ */
+int notif_get_error_kind(void);
+
+/*
+ * Server info is cached per context. While it is cached, notifications
+ * are adapted to the server: actions and sound hints are dropped when
+ * unsupported, the body is dropped without "body" and its markup is
+ * stripped without "body-markup". Nothing is adapted without it.
+ *
+ * notif_get_server_info() returns the cached info, asking the server
+ * (one round trip for both calls) when nothing is cached. Info set
+ * with notif_set_server_info(), e.g. saved by an earlier process, is
+ * dropped once a reply comes from another owner.
+ */
+int notif_get_server_info(struct NotifyServerInfo *info);
+void notif_set_server_info(const struct NotifyServerInfo *info);
+bool notif_has_server_info(void);
+
+/* Returns the capability bit of a GetCapabilities string, 0 if unknown */
+unsigned int notif_capability(const char *name);
+
+/*
+ * Subscribes to ActionInvoked and NotificationClosed signals. Must be
+ * called before sending the notifications to wait for, so no signal
+ * is missed.
+ */
+int notif_watch_events(void);
+
+/*
+ * Blocks until an action of notification id is invoked or it is closed.
+ * Signals of other notifications are skipped. Returns 1 with event
+ * filled in, 0 on timeout (in ms, -1 waits forever) and -1 on error.
+ */
+int notif_wait_event(unsigned int id, struct NotifyEvent *event, int timeout);
+
+/*
+ * A context owns one connection with its settings and error state,
+ * the functions above use a default context. Contexts share nothing:
+ * each one may be used from its own thread, but one context must not
+ * be used from two threads at once. Contexts use private connections
+ * by default.
+ */
+struct NotifyContext *notif_context_create(void);
+void notif_context_free(struct NotifyContext *ctx);
+
+void notif_context_set_private_connection(struct NotifyContext *ctx, bool private_conn);
+void notif_context_set_window_size(struct NotifyContext *ctx, unsigned int size);
+void notif_context_set_reply_timeout(struct NotifyContext *ctx, int timeout);
+void notif_context_set_trace(struct NotifyContext *ctx, struct NotifyTrace *trace);
+void notif_context_set_metrics(struct NotifyContext *ctx, struct NotifyMetrics *metrics);
+void notif_context_close(struct NotifyContext *ctx);
+
+struct NotifyStatus notif_context_send(struct NotifyContext *ctx, struct NotifyData *data);
+struct NotifyStatus notif_context_post(struct NotifyContext *ctx, struct NotifyData *data);
+int notif_context_close_notifications(struct NotifyContext *ctx, const unsigned int *ids,
+                                      unsigned int count);
+int notif_context_queue(struct NotifyContext *ctx, struct NotifyData *data,
+                        NotifyCallback callback, void *user_data);
+void notif_context_flush(struct NotifyContext *ctx);
+const char *notif_context_get_error_message(struct NotifyContext *ctx);
+int notif_context_get_error_kind(struct NotifyContext *ctx);
+int notif_context_get_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info);
+void notif_context_set_server_info(struct NotifyContext *ctx, const struct NotifyServerInfo *info);
+bool notif_context_has_server_info(struct NotifyContext *ctx);
+int notif_context_watch_events(struct NotifyContext *ctx);
+int notif_context_wait_event(struct NotifyContext *ctx, unsigned int id,
+                             struct NotifyEvent *event, int timeout);
+
+/*
+ * Called on the sender thread for every submitted notification, in
+ * submission order. status.error is only valid during the call and
+ * data is freed after it returns.
+ */
+typedef void (*NotifySubmitCallback)(struct NotifyData *data, struct NotifyStatus status,
+                                     void *user_data);
+
+struct NotifySender;
+
+/*
+ * A sender owns ctx and sends notifications submitted from any number
+ * of threads over it on its own thread. Submitting never blocks: the
+ * notification takes a slot in a lock-free ring of capacity slots
+ * (rounded up to a power of two), or -1 is returned when the ring is
+ * full. Freeing the sender sends what is left and frees ctx.
+ */
+struct NotifySender *notif_sender_create(struct NotifyContext *ctx, unsigned int capacity);
+void notif_sender_free(struct NotifySender *sender);
+int notif_submit_notification(struct NotifySender *sender, struct NotifyData *data,
+                              NotifySubmitCallback callback, void *user_data);
+
 #endif /* NOTIF_H */
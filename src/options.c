@@ -0,0 +1,553 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#include "options.h"
+#include "batch.h"
+#include "aggregate.h"
+#include "priority.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <sys/file.h>
+
+/* options of the whole run, rejected in batch records */
+#define GLOBAL_OPTIONS "hvbwTnDCXkKWGSNFMEBPQ"
+
+/* Errors go to stderr in batch mode, stdout is reserved for IDs */
+FILE *errout = NULL;
+
+static int parse_urgency(char *string)
+{
+    if (strcmp(string, "low") == 0)
+        return NOTIF_URGENCY_LOW;
+    else if (strcmp(string, "normal") == 0)
+        return NOTIF_URGENCY_NORMAL;
+    else if (strcmp(string, "critical") == 0)
+        return NOTIF_URGENCY_CRITICAL;
+
+    return NOTIF_ERROR;
+}
+
+/* Parses TYPE:NAME:VALUE, the string is split in place */
+static bool parse_hint(char *string, struct NotifyHint *hint)
+{
+    static const char *types[] = { "int", "double", "string", "byte", "boolean" };
+    static const char codes[] = { 'i', 'd', 's', 'y', 'b' };
+    char *name, *value, *end;
+    long number;
+    size_t i;
+
+    name = strchr(string, ':');
+    value = name != NULL ? strchr(name + 1, ':') : NULL;
+    if (value == NULL || value == name + 1)
+        return false;
+    *name++ = '\0';
+    *value++ = '\0';
+
+    /* category and urgency have their own options */
+    if (strcmp(name, "category") == 0 || strcmp(name, "urgency") == 0 ||
+        strcmp(name, "image-data") == 0)
+        return false;
+
+    hint->name = name;
+    hint->type = '\0';
+    for (i = 0; i < sizeof(codes); ++i) {
+        if (strcasecmp(string, types[i]) == 0)
+            hint->type = codes[i];
+    }
+
+    errno = 0;
+    switch (hint->type) {
+    case 'i':
+    case 'y':
+        number = strtol(value, &end, 0);
+        if (*value == '\0' || *end != '\0' || errno != 0 || number < INT32_MIN || number > INT32_MAX ||
+            (hint->type == 'y' && (number < 0 || number > 255)))
+            return false;
+        if (hint->type == 'i')
+            hint->value.i = (int) number;
+        else
+            hint->value.y = (unsigned char) number;
+        return true;
+    case 'd':
+        hint->value.d = strtod(value, &end);
+        return *value != '\0' && *end == '\0' && errno == 0;
+    case 's':
+        hint->value.s = value;
+        return true;
+    case 'b':
+        if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+            hint->value.b = true;
+        else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+            hint->value.b = false;
+        else
+            return false;
+        return true;
+    }
+    return false;
+}
+
+void show_help(void)
+{
+    printf("Usage:\n"
+           "notify-desktop [OPTION...] <SUMMARY> [BODY] - create a notification\n"
+           "notify-desktop --batch[=FILE] - create notifications from FILE or stdin\n"
+           "\n"
+           "Help Options:\n"
+           "  -h, --help               Show help options\n"
+           "  -v, --version            Version of the application\n"
+           "\n");
+    printf("Application Options:\n"
+           "  -r, --replaces-id=ID     Specifies the notifications ID that will be replaced\n"
+           "  -R, --id-file=PATH       Specifies the path to a file for storing the id that will be replace\n"
+           "  -k, --id-key=NAME        Replaces the notification last sent with NAME, IDs of all\n"
+           "                           names are kept in one shared ID store\n"
+           "  -K, --id-store=PATH      Specifies the ID store file\n"
+           "                           (default $XDG_RUNTIME_DIR/notify-desktop/ids)\n"
+           "  -u, --urgency=LEVEL      Specifies the urgency level (low, normal, critical)\n"
+           "  -t, --expire-time=TIME   Specifies the timeout in ms to expire the notification\n"
+           "  -a, --app-name=APP_NAME  Specifies the app name for the icon\n"
+           "  -i, --icon=ICON          Specifies an icon filename or stock icon to display\n"
+           "  -c, --category=TYPE      Specifies the notification category\n"
+           "  -g, --tag=NAME           Identifies notifications that are updates of each other,\n"
+           "                           replaces the notification last sent with NAME; tags\n"
+           "                           named GROUP/NAME belong to GROUP\n"
+           "  -G, --close-tag=GROUP    Closes all notifications tagged GROUP or GROUP/...,\n"
+           "                           then sends the notification if one is given\n"
+           "  -I, --image-data=WIDTHxHEIGHT:FILE\n"
+           "                           Shows the raw RGB or RGBA pixels in FILE as image\n"
+           "  -H, --hint=TYPE:NAME:VALUE\n"
+           "                           Adds a hint, TYPE is int, double, string, byte or\n"
+           "                           boolean; may be given up to %i times\n"
+           "  -A, --action=KEY:LABEL   Adds an action button, may be given up to %i times\n"
+           "  -W, --wait               Waits until an action is invoked or the notification\n"
+           "                           is closed and prints the action KEY or closed:REASON\n"
+           "  -T, --timeout=TIME       Specifies the timeout in ms to wait for each server reply\n"
+           "  -N, --retries=N          Sends again up to N times after a timeout or without\n"
+           "                           server or bus, waiting about 0.1s, 0.2s, 0.4s... between\n"
+           "\n", NOTIF_MAX_HINTS, NOTIF_MAX_ACTIONS);
+    printf("Batch Options:\n"
+           "  -b, --batch[=FILE]       Reads one notification per line from FILE or stdin,\n"
+           "                           each line holds application options, summary and body\n"
+           "                           quoted as in shell; all are sent over one connection\n"
+           "  -w, --window=N           Keeps up to N notifications in flight in batch mode (default %i)\n"
+           "  -n, --no-wait            Sends without waiting for reply, no ID is printed and\n"
+           "                           errors from the notification server are not detected\n"
+           "  -C, --coalesce=TIME      Reads updates like --batch and sends at most one per tag\n"
+           "                           (or replaced ID) every TIME ms, newest update wins\n"
+           "  -E, --aggregate=WINDOW   Reads events like --batch and shows each burst of events\n"
+           "                           with the same key as one notification, \"N × SUMMARY\",\n"
+           "                           updated at most once a second; a burst ends after\n"
+           "                           WINDOW ms without events\n"
+           "  -B, --aggregate-by=KEY   Groups events by tag (default), app-name or category\n"
+           "  -P, --priority[=LIMIT]   Reads records like --batch and sends critical ones first,\n"
+           "                           then normal, then low; up to LIMIT (default %i) low\n"
+           "                           records are queued, older ones and ones with the tag of\n"
+           "                           a newer one are dropped\n"
+           "\n", NOTIF_DEFAULT_WINDOW, PRIORITY_DEFAULT_LIMIT);
+    printf("Follow Options:\n"
+           "  -F, --follow=FILE        Follows FILE like tail -F and sends the notification for\n"
+           "                           every appended line that matches, may be given up to\n"
+           "                           %i times; \\0 in SUMMARY and BODY is the matched text,\n"
+           "                           \\1 to \\9 its groups, with --tag every match replaces\n"
+           "                           the notification of the previous one\n"
+           "  -M, --match=REGEX        Sends only for lines matching the extended regular\n"
+           "                           expression REGEX, may be given up to %i times\n"
+           "\n", FOLLOW_MAX_FILES, FOLLOW_MAX_PATTERNS);
+    printf("Daemon Options:\n"
+           "  -D, --daemon             Keeps one connection open and serves requests on\n"
+           "                           $XDG_RUNTIME_DIR/notify-desktop/socket, notifications\n"
+           "                           are sent through it automatically while it is running\n"
+           "\n");
+    printf("Debug Options:\n"
+           "  -X, --trace[=json]       Prints time spent in startup, parsing, connecting,\n"
+           "                           marshalling, flushing and waiting for reply on stderr\n"
+           "  -S, --server-info        Prints name, version and capabilities of the server\n"
+           "                           and refreshes their cached copy\n"
+           "  -Q, --metrics[=FILE]     Prints counts, errors and latency histograms of all\n"
+           "                           sends in Prometheus text format, or writes them to\n"
+           "                           FILE; with --daemon FILE is rewritten every %is\n"
+           "\n", METRICS_EXPORT_INTERVAL / 1000);
+    printf("Application Output:\n"
+           "   On success:             Prints ID of sent notification and returns 0\n"
+           "   On failure:             Prints error and returns 1, or %i on timeout, %i when\n"
+           "                           no notification server and %i when no bus is running\n"
+           "   With --wait:            Prints the ID, then the action KEY or closed:REASON\n"
+           "                           (expired, dismissed, closed, undefined)\n"
+           "   In batch mode:          Prints one ID per line, returns 1 if any line failed\n"
+           "\n", EXIT_TIMEOUT, EXIT_NO_SERVER, EXIT_NO_BUS);
+}
+
+void show_version(void)
+{
+    printf("notify-desktop 0.2.0\n");
+}
+
+/*
+ * Parses command line into data. Global options are only accepted
+ * when opts is not NULL, batch records pass NULL.
+ */
+int parse_arguments(int argc, char **argv, struct NotifyData *data, struct Options *opts)
+{
+    struct NotifyHint hint;
+    int opt, urgency, width, height, n;
+
+    static struct option options[] = {
+        { "help", no_argument, 0, 'h' },
+        { "version", no_argument, 0, 'v' },
+        { "replaces-id", required_argument, 0, 'r' },
+        { "urgency", required_argument, 0, 'u' },
+        { "expire", required_argument, 0, 't' },
+        { "app-name", required_argument, 0, 'a' },
+        { "id-file", required_argument, 0, 'R' },
+        { "icon", required_argument, 0, 'i' },
+        { "category", required_argument, 0, 'c' },
+        { "tag", required_argument, 0, 'g' },
+        { "batch", optional_argument, 0, 'b' },
+        { "window", required_argument, 0, 'w' },
+        { "timeout", required_argument, 0, 'T' },
+        { "no-wait", no_argument, 0, 'n' },
+        { "daemon", no_argument, 0, 'D' },
+        { "coalesce", required_argument, 0, 'C' },
+        { "trace", optional_argument, 0, 'X' },
+        { "id-key", required_argument, 0, 'k' },
+        { "id-store", required_argument, 0, 'K' },
+        { "action", required_argument, 0, 'A' },
+        { "image-data", required_argument, 0, 'I' },
+        { "hint", required_argument, 0, 'H' },
+        { "wait", no_argument, 0, 'W' },
+        { "close-tag", required_argument, 0, 'G' },
+        { "server-info", no_argument, 0, 'S' },
+        { "retries", required_argument, 0, 'N' },
+        { "follow", required_argument, 0, 'F' },
+        { "match", required_argument, 0, 'M' },
+        { "aggregate", required_argument, 0, 'E' },
+        { "aggregate-by", required_argument, 0, 'B' },
+        { "priority", optional_argument, 0, 'P' },
+        { "metrics", optional_argument, 0, 'Q' },
+        { 0, 0, 0, 0 }
+    };
+
+    /* reinitialize getopt, needed when parsing batch records */
+    optind = 0;
+
+    /* options */
+    while ((opt = getopt_long(argc, argv,"hvr:R:u:t:a:i:c:g:b::w:T:nDC:X::k:K:A:WG:I:H:SN:F:M:E:B:P::Q::", options, NULL )) != -1) {
+        /* global options apply to the whole run, not to one record */
+        if (opts == NULL && strchr(GLOBAL_OPTIONS, opt) != NULL) {
+            fprintf(errout, "Option -%c is not allowed in batch records\n", opt);
+            return PARSE_ERROR;
+        }
+
+        switch (opt) {
+        case 'h':
+            show_help();
+            return PARSE_EXIT;
+
+        case 'v':
+            show_version();
+            return PARSE_EXIT;
+
+        case 'w':
+            if (atoi(optarg) < 1) {
+                fprintf(errout, "Invalid window size!\n");
+                return PARSE_ERROR;
+            }
+            opts->window = atoi(optarg);
+            break;
+
+        case 'T':
+            opts->timeout = atoi(optarg);
+            break;
+
+        case 'n':
+            opts->no_wait = true;
+            break;
+
+        case 'D':
+            opts->daemon = true;
+            break;
+
+        case 'C':
+            if (atoi(optarg) < 1) {
+                fprintf(errout, "Invalid coalesce interval!\n");
+                return PARSE_ERROR;
+            }
+            opts->coalesce = atoi(optarg);
+            break;
+
+        case 'k':
+            opts->id_key = optarg;
+            break;
+
+        case 'K':
+            opts->id_store = optarg;
+            break;
+
+        case 'W':
+            opts->wait = true;
+            break;
+
+        case 'G':
+            opts->close_tag = optarg;
+            break;
+
+        case 'S':
+            opts->server_info = true;
+            break;
+
+        case 'N':
+            if (atoi(optarg) < 0) {
+                fprintf(errout, "Invalid number of retries!\n");
+                return PARSE_ERROR;
+            }
+            opts->retries = atoi(optarg);
+            break;
+
+        case 'P':
+            if (optarg != NULL && atoi(optarg) < 1) {
+                fprintf(errout, "Invalid priority queue limit!\n");
+                return PARSE_ERROR;
+            }
+            opts->priority = optarg != NULL ? atoi(optarg) : PRIORITY_DEFAULT_LIMIT;
+            break;
+
+        case 'Q':
+            opts->metrics = true;
+            opts->metrics_file = optarg;
+            break;
+
+        case 'E':
+            if (atoi(optarg) < 1) {
+                fprintf(errout, "Invalid aggregation window!\n");
+                return PARSE_ERROR;
+            }
+            opts->aggregate = atoi(optarg);
+            break;
+
+        case 'B':
+            if (strcmp(optarg, "tag") == 0) {
+                opts->aggregate_by = AGGREGATE_BY_TAG;
+            }
+            else if (strcmp(optarg, "app-name") == 0) {
+                opts->aggregate_by = AGGREGATE_BY_APP_NAME;
+            }
+            else if (strcmp(optarg, "category") == 0) {
+                opts->aggregate_by = AGGREGATE_BY_CATEGORY;
+            }
+            else {
+                fprintf(errout, "Invalid aggregation key!\n");
+                return PARSE_ERROR;
+            }
+            break;
+
+        case 'F':
+            if (opts->follow_count == FOLLOW_MAX_FILES) {
+                fprintf(errout, "Too many files to follow, at most %i\n", FOLLOW_MAX_FILES);
+                return PARSE_ERROR;
+            }
+            opts->follow[opts->follow_count++] = optarg;
+            break;
+
+        case 'M':
+            if (opts->match_count == FOLLOW_MAX_PATTERNS) {
+                fprintf(errout, "Too many patterns, at most %i\n", FOLLOW_MAX_PATTERNS);
+                return PARSE_ERROR;
+            }
+            opts->match[opts->match_count++] = optarg;
+            break;
+
+        case 'X':
+            if (optarg == NULL || strcmp(optarg, "line") == 0) {
+                opts->trace = TRACE_LINE;
+            }
+            else if (strcmp(optarg, "json") == 0) {
+                opts->trace = TRACE_JSON;
+            }
+            else {
+                fprintf(errout, "Invalid trace format!\n");
+                return PARSE_ERROR;
+            }
+            break;
+
+        case 'b':
+            opts->batch = true;
+            opts->batch_file = optarg;
+            break;
+
+        case 'r':
+            if (notif_get_id_file(data) != stdout) {
+                fprintf(errout, "-r and -R are incompatible options\n");
+                return PARSE_ERROR;
+            }
+            notif_set_replaces_id(data, atoi(optarg));
+            break;
+
+        case 'R': {
+            /*
+             * The file stays locked until the record is freed, records
+             * in flight together would wait on each other's lock.
+             */
+            if (opts == NULL) {
+                fprintf(errout, "Option -R is not allowed in batch records, use --tag\n");
+                return PARSE_ERROR;
+            }
+            if (notif_get_replaces_id(data) != 0) {
+                fprintf(errout, "-r and -R are incompatible options\n");
+                return PARSE_ERROR;
+            }
+            FILE *file = fopen(optarg, "r+");
+            if (file == NULL) {
+                perror("Could not open the id_file");
+                return PARSE_ERROR;
+            }
+            /* held until the new id is written, parallel runs take turns */
+            flock(fileno(file), LOCK_EX);
+            notif_set_id_file(data, file);
+            if (notif_set_replaces_id_from_file(data) == -1) {
+                perror("Could not read from file");
+                return PARSE_ERROR;
+            }
+            break;
+        }
+        case 'u':
+            urgency = parse_urgency(optarg);
+            if (urgency == NOTIF_ERROR) {
+                fprintf(errout, "Invalid urgency value!\n");
+                return PARSE_ERROR;
+            }
+            notif_set_urgency(data, urgency);
+            break;
+
+        case 't':
+            notif_set_expire_time(data, atoi(optarg));
+            break;
+
+        case 'a':
+            notif_set_app_name(data, optarg);
+            break;
+
+        case 'i':
+            notif_set_icon(data, optarg);
+            break;
+
+        case 'c':
+            notif_set_category(data, optarg);
+            break;
+
+        case 'g':
+            notif_set_tag(data, optarg);
+            break;
+
+        case 'I':
+            n = 0;
+            if (sscanf(optarg, "%ix%i:%n", &width, &height, &n) != 2 || n == 0 ||
+                width < 1 || height < 1 || optarg[n] == '\0') {
+                fprintf(errout, "Invalid image data, use WIDTHxHEIGHT:FILE\n");
+                return PARSE_ERROR;
+            }
+            notif_set_image_data(data, optarg + n, width, height);
+            break;
+
+        case 'H':
+            if (!parse_hint(optarg, &hint)) {
+                fprintf(errout, "Invalid hint, use TYPE:NAME:VALUE\n");
+                return PARSE_ERROR;
+            }
+            if (!notif_add_hint(data, &hint)) {
+                fprintf(errout, "Too many hints!\n");
+                return PARSE_ERROR;
+            }
+            break;
+
+        case 'A': {
+            /* keys cannot contain ':', so closed:REASON is never a key */
+            char *label = strchr(optarg, ':');
+            if (label == NULL || label == optarg) {
+                fprintf(errout, "Invalid action, use KEY:LABEL\n");
+                return PARSE_ERROR;
+            }
+            *label++ = '\0';
+            if (!notif_add_action(data, optarg, label)) {
+                fprintf(errout, "Too many actions!\n");
+                return PARSE_ERROR;
+            }
+            break;
+        }
+
+        default:
+            fprintf(errout, "Usage:\nnotify-desktop [OPTION...] <SUMMARY> [BODY] - create a notification\n");
+            return PARSE_ERROR;
+        }
+    }
+
+    /* summary + body */
+    for (; optind < argc; ++optind) {
+        if (notif_get_summary(data) == NULL) {
+            notif_set_summary(data, argv[optind]);
+        }
+        else if (notif_get_body(data) == NULL) {
+            notif_set_body(data, argv[optind]);
+        }
+        else {
+            fprintf(errout, "Too many arguments!\n");
+            return PARSE_ERROR;
+        }
+    }
+
+    return PARSE_OK;
+}
+
+/*
+ * Parses one batch record into data. Returns PARSE_EMPTY for blank
+ * and comment lines.
+ */
+int parse_record(char *line, struct NotifyData *data)
+{
+    char *args[BATCH_MAX_ARGS + 2];
+    int argc;
+
+    args[0] = "notify-desktop";
+
+    argc = batch_split_line(line, args + 1, BATCH_MAX_ARGS);
+    if (argc == 0)
+        return PARSE_EMPTY;
+
+    if (argc < 0) {
+        fprintf(errout, "Unterminated quote or too many arguments\n");
+        return PARSE_ERROR;
+    }
+
+    args[argc + 1] = NULL;
+
+    if (parse_arguments(argc + 1, args, data, NULL) != PARSE_OK)
+        return PARSE_ERROR;
+
+    if (!notif_validate_data(data)) {
+        fprintf(errout, "Missing summary\n");
+        return PARSE_ERROR;
+    }
+
+    return PARSE_OK;
+}
@@ -0,0 +1,75 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "notif.h"
+
+#define PARSE_OK 0
+#define PARSE_EXIT 1
+#define PARSE_ERROR 2
+#define PARSE_EMPTY 3
+
+#define TRACE_OFF 0
+#define TRACE_LINE 1
+#define TRACE_JSON 2
+
+#define FOLLOW_MAX_FILES 16
+#define FOLLOW_MAX_PATTERNS 16
+
+/* exit codes besides 0 and 1 */
+#define EXIT_TIMEOUT 3
+#define EXIT_NO_SERVER 4
+#define EXIT_NO_BUS 5
+
+struct Options {
+    bool batch;
+    const char *batch_file;
+    unsigned int window;
+    int timeout;
+    bool no_wait;
+    bool daemon;
+    int coalesce;
+    int trace;
+    const char *id_key;
+    const char *id_store;
+    bool wait;
+    const char *close_tag;
+    bool server_info;
+    int retries;
+    const char *follow[FOLLOW_MAX_FILES];
+    unsigned int follow_count;
+    const char *match[FOLLOW_MAX_PATTERNS];
+    unsigned int match_count;
+    int aggregate;
+    int aggregate_by;
+    unsigned int priority;
+    bool metrics;
+    const char *metrics_file;
+};
+
+extern FILE *errout;
+
+void show_help(void);
+void show_version(void);
+
+int parse_arguments(int argc, char **argv, struct NotifyData *data, struct Options *opts);
+int parse_record(char *line, struct NotifyData *data);
+
+#endif /* OPTIONS_H */
@@ -0,0 +1,287 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Urgency scheduling of notifications read from stdin.
+ *
+ * Records are read as soon as they arrive and queued by urgency, one
+ * FIFO of up to limit records per level. Input is read again after
+ * every Notify call, and the next call always takes the most urgent
+ * queued record, so a critical notification waits for at most one
+ * call (plus a reply when the window is full), never for the low
+ * backlog. Calls are pipelined like in batch mode.
+ *
+ * Under overload low urgency records are shed: a low record replaces
+ * a queued one with the same tag (coalesced), and when the low queue
+ * is full its oldest record is dropped. Normal and critical records
+ * are never dropped, input is not read while their queue is full.
+ */
+
+#include "priority.h"
+#include "batch.h"
+#include "options.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PRIORITY_LEVELS 3
+
+struct PriorityQueue {
+    struct NotifyData **items;
+    unsigned int head;
+    unsigned int count;
+};
+
+struct PriorityCounters {
+    unsigned long sent[PRIORITY_LEVELS];
+    unsigned long shed;
+    unsigned long coalesced;
+};
+
+static struct PriorityQueue _priority_queues[PRIORITY_LEVELS];
+static unsigned int _priority_limit;
+static struct PriorityCounters _priority_counters;
+
+static struct NotifyData **queue_at(struct PriorityQueue *queue, unsigned int i)
+{
+    return &queue->items[(queue->head + i) % _priority_limit];
+}
+
+static struct NotifyData *queue_pop(struct PriorityQueue *queue)
+{
+    struct NotifyData *data = *queue_at(queue, 0);
+
+    queue->head = (queue->head + 1) % _priority_limit;
+    --queue->count;
+    return data;
+}
+
+static bool queue_full(int level)
+{
+    return _priority_queues[level].count == _priority_limit;
+}
+
+/* Low records replace a queued one with the same tag */
+static bool coalesce_low(struct NotifyData *data)
+{
+    struct PriorityQueue *queue = &_priority_queues[NOTIF_URGENCY_LOW];
+    const char *tag = notif_get_tag(data), *queued;
+    struct NotifyData **item;
+    unsigned int i;
+
+    if (tag == NULL)
+        return false;
+
+    for (i = 0; i < queue->count; ++i) {
+        item = queue_at(queue, i);
+        queued = notif_get_tag(*item);
+        if (queued != NULL && strcmp(queued, tag) == 0) {
+            notif_free_data(*item);
+            *item = data;
+            ++_priority_counters.coalesced;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void enqueue(struct NotifyData *data)
+{
+    int level = notif_get_urgency(data);
+    struct PriorityQueue *queue;
+
+    if (level < 0 || level >= PRIORITY_LEVELS)
+        level = NOTIF_URGENCY_NORMAL;
+    queue = &_priority_queues[level];
+
+    if (level == NOTIF_URGENCY_LOW) {
+        if (coalesce_low(data))
+            return;
+        if (queue_full(level)) {
+            notif_free_data(queue_pop(queue));
+            ++_priority_counters.shed;
+        }
+    }
+
+    *queue_at(queue, queue->count++) = data;
+}
+
+static struct NotifyData *dequeue(void)
+{
+    int level;
+
+    for (level = NOTIF_URGENCY_CRITICAL; level >= NOTIF_URGENCY_LOW; --level) {
+        if (_priority_queues[level].count > 0)
+            return queue_pop(&_priority_queues[level]);
+    }
+    return NULL;
+}
+
+static void priority_sent(struct NotifyData *data, int id, void *user_data)
+{
+    int *ret = (int*) user_data;
+
+    if (id == -1) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        *ret = 1;
+    }
+    else {
+        fprintf(notif_get_id_file(data), "%i\n", id);
+        fflush(notif_get_id_file(data));
+    }
+
+    notif_free_data(data);
+}
+
+static void send_next(int *ret)
+{
+    struct NotifyData *data = dequeue();
+    int level = notif_get_urgency(data);
+
+    if (notif_queue_notification(data, priority_sent, ret) != 0) {
+        fprintf(errout, "Error: %s\n", notif_get_error_message());
+        notif_free_error_message();
+        notif_free_data(data);
+        *ret = 1;
+        return;
+    }
+
+    if (level >= 0 && level < PRIORITY_LEVELS)
+        ++_priority_counters.sent[level];
+}
+
+/* A full normal or critical queue holds input back */
+static bool held_back(void)
+{
+    return queue_full(NOTIF_URGENCY_NORMAL) || queue_full(NOTIF_URGENCY_CRITICAL);
+}
+
+/*
+ * Queues the complete records read so far. Stops while held back, the
+ * remaining lines stay in input until their queue has room.
+ */
+static void parse_records(struct BatchInput *input, int *lineno, int *ret)
+{
+    struct NotifyData *data;
+    char *line;
+    int parsed;
+
+    while (!held_back() && (line = batch_input_line(input)) != NULL) {
+        ++*lineno;
+
+        data = notif_create_data();
+        if (data == NULL) {
+            fprintf(errout, "Line %i: Out Of Memory!\n", *lineno);
+            *ret = 1;
+            continue;
+        }
+        parsed = parse_record(line, data);
+
+        if (parsed == PARSE_OK) {
+            enqueue(data);
+            continue;
+        }
+
+        if (parsed != PARSE_EMPTY) {
+            fprintf(errout, "Line %i: invalid record\n", *lineno);
+            *ret = 1;
+        }
+        notif_free_data(data);
+    }
+}
+
+static bool queued(void)
+{
+    int level;
+
+    for (level = 0; level < PRIORITY_LEVELS; ++level) {
+        if (_priority_queues[level].count > 0)
+            return true;
+    }
+    return false;
+}
+
+int priority_run(unsigned int limit)
+{
+    struct BatchInput input;
+    struct pollfd pfd;
+    bool reading = true;
+    int level, lineno = 0, ret = 0;
+
+    _priority_limit = limit;
+    for (level = 0; level < PRIORITY_LEVELS; ++level) {
+        _priority_queues[level].items = (struct NotifyData**) calloc(limit, sizeof(struct NotifyData*));
+        if (_priority_queues[level].items == NULL) {
+            fprintf(errout, "Error: Out Of Memory!\n");
+            return 1;
+        }
+    }
+
+    batch_input_init(&input, STDIN_FILENO);
+    pfd.fd = input.fd;
+    pfd.events = POLLIN;
+
+    while (reading || queued()) {
+        if (reading && !held_back())
+            parse_records(&input, &lineno, &ret);
+
+        /* input is read only when all buffered records are queued */
+        if (reading && !held_back()) {
+            if (input.eof) {
+                reading = false;
+            }
+            else {
+                if (!queued())
+                    notif_flush_queue();
+                if (poll(&pfd, 1, queued() ? 0 : -1) > 0) {
+                    if (batch_input_fill(&input) < 0) {
+                        perror("Could not read input");
+                        ret = 1;
+                        reading = false;
+                    }
+                    else {
+                        parse_records(&input, &lineno, &ret);
+                    }
+                }
+            }
+        }
+
+        if (queued())
+            send_next(&ret);
+    }
+
+    notif_flush_queue();
+
+    if (_priority_counters.shed > 0 || _priority_counters.coalesced > 0)
+        fprintf(stderr, "priority: sent %lu critical, %lu normal, %lu low; "
+                "low shed %lu, coalesced %lu\n",
+                _priority_counters.sent[NOTIF_URGENCY_CRITICAL],
+                _priority_counters.sent[NOTIF_URGENCY_NORMAL],
+                _priority_counters.sent[NOTIF_URGENCY_LOW],
+                _priority_counters.shed, _priority_counters.coalesced);
+
+    for (level = 0; level < PRIORITY_LEVELS; ++level)
+        free(_priority_queues[level].items);
+    batch_input_free(&input);
+
+    return ret;
+}
@@ -0,0 +1,281 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Asynchronous sending. Producers put notifications into a bounded
+ * ring, one sender thread takes them out and queues them on its
+ * context, so any number of threads share one connection without
+ * locking it.
+ *
+ * The ring is a multi-producer single-consumer queue of slots with
+ * sequence numbers: a slot at position pos is free when its sequence
+ * is pos and filled when it is pos + 1. Producers claim positions
+ * with compare-and-swap, the sender reads them in order.
+ *
+ * The sender sleeps on an eventfd when the ring is empty. Producers
+ * only write to it when the sender announced it is going to sleep.
+ */
+
+#include "notif.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct SenderSlot {
+    atomic_size_t sequence;
+    struct NotifyData *data;
+    NotifySubmitCallback callback;
+    void *user_data;
+};
+
+struct SenderCompletion {
+    NotifySubmitCallback callback;
+    void *user_data;
+};
+
+struct NotifySender {
+    struct NotifyContext *ctx;
+    pthread_t thread;
+    int wakeup;
+
+    struct SenderSlot *ring;
+    size_t mask;
+    atomic_size_t tail;
+    size_t head;
+    atomic_bool sleeping;
+    atomic_bool quit;
+
+    /* callbacks of notifications queued on ctx, in queue order */
+    struct SenderCompletion *inflight;
+    size_t inflight_head;
+    size_t inflight_count;
+};
+
+static void wake_sender(struct NotifySender *sender)
+{
+    uint64_t one = 1;
+
+    while (write(sender->wakeup, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static bool take_slot(struct NotifySender *sender, struct SenderSlot *item)
+{
+    struct SenderSlot *slot = &sender->ring[sender->head & sender->mask];
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != sender->head + 1)
+        return false;
+
+    item->data = slot->data;
+    item->callback = slot->callback;
+    item->user_data = slot->user_data;
+
+    /* free the slot for the producer one lap ahead */
+    atomic_store_explicit(&slot->sequence, sender->head + sender->mask + 1, memory_order_release);
+    ++sender->head;
+    return true;
+}
+
+static bool ring_empty(struct NotifySender *sender)
+{
+    struct SenderSlot *slot = &sender->ring[sender->head & sender->mask];
+
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) != sender->head + 1;
+}
+
+static void complete(struct NotifySender *sender, struct NotifyData *data, struct NotifyStatus status)
+{
+    struct SenderCompletion *c = &sender->inflight[sender->inflight_head];
+
+    sender->inflight_head = (sender->inflight_head + 1) & sender->mask;
+    --sender->inflight_count;
+
+    if (c->callback != NULL)
+        c->callback(data, status, c->user_data);
+    notif_free_data(data);
+}
+
+static void queued_done(struct NotifyData *data, int id, void *user_data)
+{
+    struct NotifySender *sender = (struct NotifySender*) user_data;
+    struct NotifyStatus status;
+
+    status.id = id;
+    status.error = id == -1 ? notif_context_get_error_message(sender->ctx) : NULL;
+    status.error_kind = id == -1 ? notif_context_get_error_kind(sender->ctx) : 0;
+    complete(sender, data, status);
+}
+
+static void send_item(struct NotifySender *sender, struct SenderSlot *item)
+{
+    struct SenderCompletion *c;
+    struct NotifyStatus status;
+
+    if (sender->inflight_count > sender->mask)
+        notif_context_flush(sender->ctx);
+
+    c = &sender->inflight[(sender->inflight_head + sender->inflight_count) & sender->mask];
+    c->callback = item->callback;
+    c->user_data = item->user_data;
+    ++sender->inflight_count;
+
+    if (notif_context_queue(sender->ctx, item->data, queued_done, sender) == 0)
+        return;
+
+    /* not queued, so it is the newest entry and completes right away */
+    --sender->inflight_count;
+    status.id = -1;
+    status.error = notif_context_get_error_message(sender->ctx);
+    status.error_kind = notif_context_get_error_kind(sender->ctx);
+    if (c->callback != NULL)
+        c->callback(item->data, status, c->user_data);
+    notif_free_data(item->data);
+}
+
+static void *sender_thread(void *arg)
+{
+    struct NotifySender *sender = (struct NotifySender*) arg;
+    struct SenderSlot item;
+    struct pollfd pfd;
+    uint64_t value;
+
+    pfd.fd = sender->wakeup;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        while (take_slot(sender, &item))
+            send_item(sender, &item);
+
+        /* the batch is written, wait for its replies */
+        notif_context_flush(sender->ctx);
+
+        if (atomic_load(&sender->quit) && ring_empty(sender))
+            break;
+
+        atomic_store(&sender->sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!ring_empty(sender) || atomic_load(&sender->quit)) {
+            atomic_store(&sender->sleeping, false);
+            continue;
+        }
+
+        if (poll(&pfd, 1, -1) > 0)
+            while (read(sender->wakeup, &value, sizeof(value)) < 0 && errno == EINTR)
+                ;
+        atomic_store(&sender->sleeping, false);
+    }
+
+    return NULL;
+}
+
+struct NotifySender *notif_sender_create(struct NotifyContext *ctx, unsigned int capacity)
+{
+    struct NotifySender *sender;
+    size_t size, i;
+
+    for (size = 1; size < capacity; size *= 2)
+        ;
+
+    sender = (struct NotifySender*) calloc(1, sizeof(struct NotifySender));
+    if (NULL == sender)
+        return NULL;
+
+    sender->ctx = ctx;
+    sender->mask = size - 1;
+    sender->ring = (struct SenderSlot*) calloc(size, sizeof(struct SenderSlot));
+    sender->inflight = (struct SenderCompletion*) calloc(size, sizeof(struct SenderCompletion));
+    sender->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (NULL == sender->ring || NULL == sender->inflight || sender->wakeup < 0)
+        goto error;
+
+    for (i = 0; i < size; ++i)
+        atomic_init(&sender->ring[i].sequence, i);
+    atomic_init(&sender->tail, 0);
+    atomic_init(&sender->sleeping, false);
+    atomic_init(&sender->quit, false);
+
+    if (pthread_create(&sender->thread, NULL, sender_thread, sender) != 0)
+        goto error;
+
+    return sender;
+
+error:
+    if (sender->wakeup >= 0)
+        close(sender->wakeup);
+    free(sender->ring);
+    free(sender->inflight);
+    free(sender);
+    return NULL;
+}
+
+int notif_submit_notification(struct NotifySender *sender, struct NotifyData *data,
+                              NotifySubmitCallback callback, void *user_data)
+{
+    struct SenderSlot *slot;
+    size_t pos, sequence;
+
+    pos = atomic_load_explicit(&sender->tail, memory_order_relaxed);
+    for (;;) {
+        slot = &sender->ring[pos & sender->mask];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+        if (sequence == pos) {
+            if (atomic_compare_exchange_weak_explicit(&sender->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        else if ((intptr_t) (sequence - pos) < 0) {
+            /* slot still holds a notification from the previous lap */
+            return -1;
+        }
+        else {
+            pos = atomic_load_explicit(&sender->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->data = data;
+    slot->callback = callback;
+    slot->user_data = user_data;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&sender->sleeping, false))
+        wake_sender(sender);
+
+    return 0;
+}
+
+void notif_sender_free(struct NotifySender *sender)
+{
+    atomic_store(&sender->quit, true);
+    wake_sender(sender);
+    pthread_join(sender->thread, NULL);
+
+    notif_context_free(sender->ctx);
+    close(sender->wakeup);
+    free(sender->ring);
+    free(sender->inflight);
+    free(sender);
+}
@@ -0,0 +1,131 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Server info cache: one small text file holding the reply of
+ * GetServerInformation and GetCapabilities together with the unique
+ * bus name of the server that sent it. The library drops the info
+ * when a reply comes from another name, the caller then asks again
+ * and saves the new info. The file is replaced with rename(), so
+ * readers never see it half written.
+ */
+
+#define _GNU_SOURCE
+#include "servercache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SERVERCACHE_MAGIC "NDSRV1"
+
+static bool cache_path(char *path, size_t size)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int len;
+
+    if (runtime == NULL || runtime[0] == '\0')
+        return false;
+
+    len = snprintf(path, size, "%s/notify-desktop", runtime);
+    if (len < 0 || (size_t) len >= size)
+        return false;
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return false;
+
+    len = snprintf(path, size, "%s/notify-desktop/server", runtime);
+    return len > 0 && (size_t) len < size;
+}
+
+/* Reads one field into out, which holds NOTIF_INFO_SIZE bytes */
+static bool read_line(FILE *file, char *out)
+{
+    char line[NOTIF_INFO_SIZE + 1];
+    size_t len;
+
+    /* room for a full field and its newline */
+    if (fgets(line, sizeof(line), file) == NULL)
+        return false;
+
+    len = strcspn(line, "\n");
+    if (line[len] != '\n')
+        return false;
+    line[len] = '\0';
+    memcpy(out, line, len + 1);
+    return true;
+}
+
+bool server_cache_load(struct NotifyServerInfo *info)
+{
+    char path[4096], magic[NOTIF_INFO_SIZE];
+    FILE *file;
+    bool ok;
+
+    if (!cache_path(path, sizeof(path)))
+        return false;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    memset(info, 0, sizeof(*info));
+    ok = read_line(file, magic) && strcmp(magic, SERVERCACHE_MAGIC) == 0 &&
+         read_line(file, info->owner) && info->owner[0] != '\0' &&
+         read_line(file, info->name) &&
+         read_line(file, info->vendor) &&
+         read_line(file, info->version) &&
+         read_line(file, info->spec_version) &&
+         fscanf(file, "%x", &info->capabilities) == 1;
+
+    fclose(file);
+    return ok;
+}
+
+bool server_cache_save(const struct NotifyServerInfo *info)
+{
+    char path[4096], tmp[4096 + 16];
+    FILE *file;
+    bool ok;
+
+    /* newlines would shift the fields, servers do not send them */
+    if (strchr(info->name, '\n') || strchr(info->vendor, '\n') ||
+        strchr(info->version, '\n') || strchr(info->spec_version, '\n'))
+        return false;
+
+    if (!cache_path(path, sizeof(path)))
+        return false;
+    snprintf(tmp, sizeof(tmp), "%s.%i", path, (int) getpid());
+
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "%s\n%s\n%s\n%s\n%s\n%s\n%x\n", SERVERCACHE_MAGIC,
+            info->owner, info->name, info->vendor, info->version,
+            info->spec_version, info->capabilities);
+    ok = fclose(file) == 0;
+
+    if (ok && rename(tmp, path) == 0)
+        return true;
+
+    unlink(tmp);
+    return false;
+}
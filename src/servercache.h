@@ -0,0 +1,32 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+#ifndef SERVERCACHE_H
+#define SERVERCACHE_H
+
+#include "notif.h"
+
+/*
+ * Server info cached in $XDG_RUNTIME_DIR/notify-desktop/server, so
+ * invocations adapt notifications to the server without asking it.
+ * Both return false when there is no usable cache, quietly.
+ */
+bool server_cache_load(struct NotifyServerInfo *info);
+bool server_cache_save(const struct NotifyServerInfo *info);
+
+#endif /* SERVERCACHE_H */
@@ -0,0 +1,1899 @@
+/* ============================================================
+* notify-desktop - sends desktop notifications
+* Copyright (C) 2012-2015 David Rosca <nowrep@gmail.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+* ============================================================ */
+
+/*
+ * Native D-Bus backend. Speaks the wire protocol directly over the
+ * session bus unix socket, without libdbus:
+ *
+ *   AUTH EXTERNAL, BEGIN and Hello are written in one go together
+ *   with the first message, so the whole handshake costs no extra
+ *   round trip. Messages are marshalled little-endian into a flat
+ *   buffer and replies are matched by serial.
+ *
+ * Only what notify-desktop needs is implemented: basic header field
+ * types and the reply bodies sent by notification servers.
+ */
+
+#include "dbusimp.h"
+#include "image.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WIRE_DEFAULT_TIMEOUT 25000
+#define WIRE_MAX_MESSAGE (128 * 1024 * 1024)
+
+#define MESSAGE_METHOD_CALL 1
+#define MESSAGE_METHOD_RETURN 2
+#define MESSAGE_ERROR 3
+#define MESSAGE_SIGNAL 4
+
+#define FLAG_NO_REPLY_EXPECTED 0x1
+
+#define FIELD_PATH 1
+#define FIELD_INTERFACE 2
+#define FIELD_MEMBER 3
+#define FIELD_ERROR_NAME 4
+#define FIELD_REPLY_SERIAL 5
+#define FIELD_DESTINATION 6
+#define FIELD_SENDER 7
+#define FIELD_SIGNATURE 8
+
+struct Buffer {
+    char *data;
+    size_t len;
+    size_t size;
+    bool oom;
+};
+
+struct Message {
+    int type;
+    uint32_t serial;
+    uint32_t reply_serial;
+    const char *error_name;
+    const char *interface;
+    const char *member;
+    const char *sender;
+    const char *signature;
+    const unsigned char *data;
+    size_t body;
+    size_t len;
+    bool swap;
+};
+
+struct Reader {
+    const unsigned char *data;
+    size_t pos;
+    size_t len;
+    bool swap;
+    bool error;
+};
+
+struct Template {
+    bool prefix_valid;
+    bool suffix_valid;
+    char *app_name;
+    char *icon;
+    char *category;
+    unsigned char urgency;
+    unsigned int capabilities;
+    struct NotifyData *hints;
+
+    struct Buffer prefix;
+    size_t body;
+    size_t replaces_id;
+    struct Buffer suffix[2];
+};
+
+struct PendingNotification {
+    uint32_t serial;
+    struct timespec deadline;
+    double sent;
+    bool done;
+    int id;
+    char *error;
+    int error_kind;
+    struct NotifyData *data;
+    NotifyCallback callback;
+    void *user_data;
+};
+
+struct NotifyContext {
+    char *error;
+    int error_kind;
+    int fd;
+    int timeout;
+    uint32_t serial;
+    bool authenticated;
+    bool hello_done;
+
+    struct Buffer out;
+    struct Buffer in;
+    struct Template template;
+    size_t in_consumed;
+    struct NotifyTrace *trace;
+    struct NotifyMetrics *metrics;
+    bool connected;
+    char *event_key;
+    struct ImageCache images;
+    struct ServerCache server;
+
+    struct PendingNotification *queue;
+    unsigned int window;
+    unsigned int queue_head;
+    unsigned int queue_count;
+};
+
+static void create_error_message(struct NotifyContext *ctx, int kind, const char *mes)
+{
+    size_t size = strlen(mes) + 1;
+
+    ctx->error_kind = kind;
+
+    free(ctx->error);
+    ctx->error = (char*) malloc(size);
+    strncpy(ctx->error, mes, size);
+}
+
+/* marshalling */
+
+static void buf_reserve(struct Buffer *buf, size_t n)
+{
+    size_t size;
+    char *data;
+
+    if (buf->len + n <= buf->size)
+        return;
+
+    size = buf->size ? buf->size : 256;
+    while (size < buf->len + n)
+        size *= 2;
+
+    data = (char*) realloc(buf->data, size);
+    if (data == NULL) {
+        buf->oom = true;
+        return;
+    }
+    buf->data = data;
+    buf->size = size;
+}
+
+static void buf_put(struct Buffer *buf, const void *p, size_t n)
+{
+    buf_reserve(buf, n);
+    if (buf->oom)
+        return;
+    memcpy(buf->data + buf->len, p, n);
+    buf->len += n;
+}
+
+static void buf_align(struct Buffer *buf, size_t alignment)
+{
+    static const char zero[8] = { 0 };
+    size_t pad = (alignment - buf->len % alignment) % alignment;
+
+    buf_put(buf, zero, pad);
+}
+
+static void buf_put_u8(struct Buffer *buf, uint8_t value)
+{
+    buf_put(buf, &value, 1);
+}
+
+static void buf_set_u32(struct Buffer *buf, size_t pos, uint32_t value)
+{
+    unsigned char *p = (unsigned char*) buf->data + pos;
+
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+static void buf_put_u32(struct Buffer *buf, uint32_t value)
+{
+    buf_align(buf, 4);
+    buf_reserve(buf, 4);
+    if (buf->oom)
+        return;
+    buf_set_u32(buf, buf->len, value);
+    buf->len += 4;
+}
+
+static void buf_put_string(struct Buffer *buf, const char *string)
+{
+    size_t len = strlen(string);
+
+    buf_put_u32(buf, len);
+    buf_put(buf, string, len + 1);
+}
+
+static void buf_put_signature(struct Buffer *buf, const char *signature)
+{
+    size_t len = strlen(signature);
+
+    buf_put_u8(buf, len);
+    buf_put(buf, signature, len + 1);
+}
+
+/*
+ * Arrays are written as length placeholder followed by elements,
+ * the length is patched in buf_close_array().
+ */
+static size_t buf_open_array(struct Buffer *buf, size_t alignment, size_t *start)
+{
+    size_t pos;
+
+    buf_put_u32(buf, 0);
+    pos = buf->len - 4;
+    buf_align(buf, alignment);
+    *start = buf->len;
+    return pos;
+}
+
+static void buf_close_array(struct Buffer *buf, size_t pos, size_t start)
+{
+    if (!buf->oom)
+        buf_set_u32(buf, pos, buf->len - start);
+}
+
+static void buf_put_field(struct Buffer *buf, uint8_t code, const char *type, const char *value)
+{
+    buf_align(buf, 8);
+    buf_put_u8(buf, code);
+    buf_put_signature(buf, type);
+    if (type[0] == 'g')
+        buf_put_signature(buf, value);
+    else
+        buf_put_string(buf, value);
+}
+
+/*
+ * Writes message header into empty buffer, returns offset of the body.
+ * Header is padded to 8 bytes, so body offsets have the same alignment
+ * as offsets in the whole message. Serial is set by send_message(ctx).
+ */
+static size_t start_message(struct Buffer *buf, int type, int flags,
+                            const char *destination, const char *path,
+                            const char *interface, const char *member,
+                            const char *signature)
+{
+    size_t pos, start;
+
+    buf->len = 0;
+    buf->oom = false;
+
+    buf_put_u8(buf, 'l');
+    buf_put_u8(buf, type);
+    buf_put_u8(buf, flags);
+    buf_put_u8(buf, 1);
+    buf_put_u32(buf, 0);
+    buf_put_u32(buf, 0);
+
+    pos = buf_open_array(buf, 8, &start);
+    buf_put_field(buf, FIELD_PATH, "o", path);
+    if (interface != NULL)
+        buf_put_field(buf, FIELD_INTERFACE, "s", interface);
+    buf_put_field(buf, FIELD_MEMBER, "s", member);
+    buf_put_field(buf, FIELD_DESTINATION, "s", destination);
+    if (signature[0] != '\0')
+        buf_put_field(buf, FIELD_SIGNATURE, "g", signature);
+    buf_close_array(buf, pos, start);
+    buf_align(buf, 8);
+
+    return buf->len;
+}
+
+static void end_message(struct Buffer *buf, size_t body)
+{
+    if (!buf->oom)
+        buf_set_u32(buf, 4, buf->len - body);
+}
+
+/*
+ * Notify messages are built from a template. The header, app_name and
+ * app_icon are marshalled once and reused while app_name and icon stay
+ * the same, the hints while category, urgency and the other hints stay
+ * the same:
+ *
+ *   prefix:  header, app_name, replaces_id, app_icon
+ *   summary, body and actions are appended
+ *   suffix:  hints
+ *   image-data hint and expire_timeout are appended
+ *
+ * Alignment inside the suffix depends on where actions end, so it is
+ * prepared for both possible offsets (0 and 4 modulo 8).
+ */
+static bool same_string(const char *cached, const char *string)
+{
+    return cached != NULL && strcmp(cached, string) == 0;
+}
+
+static bool same_hint(const struct NotifyHint *a, const struct NotifyHint *b)
+{
+    if (a->type != b->type || strcmp(a->name, b->name) != 0)
+        return false;
+
+    switch (a->type) {
+    case 'i': return a->value.i == b->value.i;
+    case 'd': return a->value.d == b->value.d;
+    case 's': return strcmp(a->value.s, b->value.s) == 0;
+    case 'y': return a->value.y == b->value.y;
+    case 'b': return a->value.b == b->value.b;
+    }
+    return false;
+}
+
+static bool prefix_matches(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    struct Template *t = &ctx->template;
+
+    return t->prefix_valid &&
+           same_string(t->app_name, notif_get_app_name(data)) &&
+           same_string(t->icon, notif_get_icon(data));
+}
+
+static bool suffix_matches(struct NotifyContext *ctx, struct NotifyData *data, unsigned int capabilities)
+{
+    struct Template *t = &ctx->template;
+    unsigned int i, count = notif_get_hint_count(data);
+
+    if (!t->suffix_valid ||
+        t->capabilities != capabilities ||
+        t->urgency != notif_get_urgency(data) ||
+        !same_string(t->category, notif_get_category(data)) ||
+        notif_get_hint_count(t->hints) != count)
+        return false;
+
+    for (i = 0; i < count; ++i) {
+        if (!same_hint(notif_get_hint(t->hints, i), notif_get_hint(data, i)))
+            return false;
+    }
+    return true;
+}
+
+static void put_hint(struct Buffer *buf, const struct NotifyHint *hint)
+{
+    char signature[2] = { hint->type, '\0' };
+    uint64_t bits;
+
+    buf_align(buf, 8);
+    buf_put_string(buf, hint->name);
+    buf_put_signature(buf, signature);
+
+    switch (hint->type) {
+    case 'i':
+        buf_put_u32(buf, (uint32_t) hint->value.i);
+        break;
+    case 'd':
+        /* little endian like the message */
+        memcpy(&bits, &hint->value.d, sizeof(bits));
+        buf_align(buf, 8);
+        buf_put_u32(buf, (uint32_t) bits);
+        buf_put_u32(buf, (uint32_t) (bits >> 32));
+        break;
+    case 's':
+        buf_put_string(buf, hint->value.s);
+        break;
+    case 'y':
+        buf_put_u8(buf, hint->value.y);
+        break;
+    case 'b':
+        buf_put_u32(buf, hint->value.b);
+        break;
+    }
+}
+
+static void put_suffix(struct Buffer *buf, struct NotifyData *data, unsigned int capabilities)
+{
+    const struct NotifyHint *hint;
+    size_t hints, hints_start;
+    unsigned int i;
+
+    /* hints DICT */
+    hints = buf_open_array(buf, 8, &hints_start);
+
+    buf_align(buf, 8);
+    buf_put_string(buf, "category");
+    buf_put_signature(buf, "s");
+    buf_put_string(buf, notif_get_category(data));
+
+    buf_align(buf, 8);
+    buf_put_string(buf, "urgency");
+    buf_put_signature(buf, "y");
+    buf_put_u8(buf, notif_get_urgency(data));
+
+    for (i = 0; i < notif_get_hint_count(data); ++i) {
+        hint = notif_get_hint(data, i);
+        if (_notif_hint_supported(capabilities, hint->name))
+            put_hint(buf, hint);
+    }
+
+    buf_close_array(buf, hints, hints_start);
+}
+
+/*
+ * image-data hint (iiibiiay): width, height, rowstride, has_alpha,
+ * bits_per_sample, channels and the pixels, copied from the cached copy
+ */
+static void put_image(struct Buffer *buf, const struct NotifyImage *image)
+{
+    buf_align(buf, 8);
+    buf_put_string(buf, "image-data");
+    buf_put_signature(buf, "(iiibiiay)");
+
+    buf_align(buf, 8);
+    buf_put_u32(buf, (uint32_t) image->width);
+    buf_put_u32(buf, (uint32_t) image->height);
+    buf_put_u32(buf, (uint32_t) image->rowstride);
+    buf_put_u32(buf, image->channels == 4);
+    buf_put_u32(buf, 8);
+    buf_put_u32(buf, (uint32_t) image->channels);
+    buf_put_u32(buf, (uint32_t) image->size);
+    buf_put(buf, image->pixels, image->size);
+}
+
+static bool update_prefix(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    struct Template *t = &ctx->template;
+
+    t->prefix_valid = false;
+    free(t->app_name);
+    free(t->icon);
+    t->app_name = strdup(notif_get_app_name(data));
+    t->icon = strdup(notif_get_icon(data));
+
+    t->body = start_message(&t->prefix, MESSAGE_METHOD_CALL, 0,
+                            "org.freedesktop.Notifications",
+                            "/org/freedesktop/Notifications",
+                            "org.freedesktop.Notifications",
+                            "Notify", "susssasa{sv}i");
+
+    buf_put_string(&t->prefix, notif_get_app_name(data));
+    buf_put_u32(&t->prefix, 0);
+    t->replaces_id = t->prefix.len - 4;
+    buf_put_string(&t->prefix, notif_get_icon(data));
+
+    if (t->prefix.oom || t->app_name == NULL || t->icon == NULL) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+
+    t->prefix_valid = true;
+    return true;
+}
+
+/* Body as the server can show it, markup is stripped in place */
+static void put_body(struct Buffer *buf, const char *body, unsigned int capabilities)
+{
+    size_t pos, len;
+
+    if (!(capabilities & NOTIF_CAP_BODY))
+        body = "";
+
+    if ((capabilities & NOTIF_CAP_BODY_MARKUP) || strpbrk(body, "<&") == NULL) {
+        buf_put_string(buf, body);
+        return;
+    }
+
+    buf_put_u32(buf, 0);
+    pos = buf->len - 4;
+    buf_reserve(buf, strlen(body) + 1);
+    if (buf->oom)
+        return;
+    len = _notif_strip_markup(buf->data + buf->len, body);
+    buf_set_u32(buf, pos, len);
+    buf->len += len + 1;
+}
+
+static bool update_suffix(struct NotifyContext *ctx, struct NotifyData *data, unsigned int capabilities)
+{
+    struct Template *t = &ctx->template;
+    struct Buffer *suffix;
+    unsigned int i;
+    size_t offset;
+
+    t->suffix_valid = false;
+    free(t->category);
+    t->category = strdup(notif_get_category(data));
+    t->urgency = notif_get_urgency(data);
+    t->capabilities = capabilities;
+
+    /* hints are compared against a copy */
+    if (t->hints == NULL)
+        t->hints = notif_create_data();
+    else
+        notif_reset_data(t->hints);
+    if (t->hints == NULL) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+    for (i = 0; i < notif_get_hint_count(data); ++i)
+        notif_add_hint(t->hints, notif_get_hint(data, i));
+
+    for (offset = 0; offset < 2; ++offset) {
+        suffix = &t->suffix[offset];
+        suffix->len = 0;
+        suffix->oom = false;
+
+        /* marshal at the right alignment, then drop the padding */
+        buf_reserve(suffix, 4);
+        suffix->len = offset * 4;
+        put_suffix(suffix, data, capabilities);
+        if (!suffix->oom) {
+            memmove(suffix->data, suffix->data + offset * 4, suffix->len - offset * 4);
+            suffix->len -= offset * 4;
+        }
+    }
+
+    if (t->suffix[0].oom || t->suffix[1].oom || t->category == NULL) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+
+    t->suffix_valid = true;
+    return true;
+}
+
+static bool create_message(struct NotifyContext *ctx, struct Buffer *buf, struct NotifyData *data, int flags)
+{
+    struct Template *t = &ctx->template;
+    const struct NotifyImage *image;
+    char errorbuf[255];
+    size_t actions, actions_start, hints;
+    unsigned int i, capabilities = _notif_server_capabilities(&ctx->server);
+    bool prefix, suffix;
+    const char *invalid;
+
+    if (_notif_data_out_of_memory(data)) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+
+    prefix = prefix_matches(ctx, data);
+    suffix = suffix_matches(ctx, data, capabilities);
+
+    /* the bus disconnects senders of invalid strings, templates hold valid ones */
+    invalid = _notif_invalid_string(data, !prefix || !suffix);
+    if (invalid != NULL) {
+        snprintf(errorbuf, sizeof(errorbuf), "Invalid UTF-8 in %s", invalid);
+        create_error_message(ctx, NOTIF_ERROR_OTHER, errorbuf);
+        return false;
+    }
+
+    if (!prefix && !update_prefix(ctx, data))
+        return false;
+    if (!suffix && !update_suffix(ctx, data, capabilities))
+        return false;
+
+    buf->len = 0;
+    buf->oom = false;
+
+    buf_put(buf, t->prefix.data, t->prefix.len);
+    if (!buf->oom) {
+        buf->data[2] = flags;
+        buf_set_u32(buf, t->replaces_id, notif_get_replaces_id(data));
+    }
+
+    buf_put_string(buf, notif_get_summary(data));
+    put_body(buf, notif_get_body(data), capabilities);
+
+    /* actions ARRAY - key and label of each action */
+    actions = buf_open_array(buf, 4, &actions_start);
+    for (i = 0; i < notif_get_action_count(data) && (capabilities & NOTIF_CAP_ACTIONS); ++i) {
+        buf_put_string(buf, notif_get_action_key(data, i));
+        buf_put_string(buf, notif_get_action_label(data, i));
+    }
+    buf_close_array(buf, actions, actions_start);
+
+    buf_align(buf, 4);
+    hints = buf->len;
+    buf_put(buf, t->suffix[buf->len % 8 / 4].data, t->suffix[buf->len % 8 / 4].len);
+
+    if (notif_get_image_path(data) != NULL) {
+        image = image_cache_get(&ctx->images, notif_get_image_path(data),
+                                notif_get_image_width(data), notif_get_image_height(data),
+                                errorbuf, sizeof(errorbuf));
+        if (image == NULL) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, errorbuf);
+            return false;
+        }
+
+        /* hints gain an entry, entries start 8 byte aligned after the length */
+        put_image(buf, image);
+        buf_close_array(buf, hints, (hints + 4 + 7) & ~(size_t) 7);
+    }
+
+    /* expire_timeout INT32 */
+    buf_put_u32(buf, (uint32_t) notif_get_expire_time(data));
+
+    end_message(buf, t->body);
+
+    if (buf->oom) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+    if (buf->len > WIRE_MAX_MESSAGE) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Notification too large");
+        return false;
+    }
+    return true;
+}
+
+/* demarshalling */
+
+static uint32_t read_u32_at(const unsigned char *p, bool swap)
+{
+    if (swap)
+        return (uint32_t) p[3] | (uint32_t) p[2] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[0] << 24;
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void rd_align(struct Reader *r, size_t alignment)
+{
+    r->pos += (alignment - r->pos % alignment) % alignment;
+    if (r->pos > r->len)
+        r->error = true;
+}
+
+static uint8_t rd_u8(struct Reader *r)
+{
+    if (r->error || r->pos + 1 > r->len) {
+        r->error = true;
+        return 0;
+    }
+    return r->data[r->pos++];
+}
+
+static uint32_t rd_u32(struct Reader *r)
+{
+    uint32_t value;
+
+    rd_align(r, 4);
+    if (r->error || r->pos + 4 > r->len) {
+        r->error = true;
+        return 0;
+    }
+    value = read_u32_at(r->data + r->pos, r->swap);
+    r->pos += 4;
+    return value;
+}
+
+static const char *rd_bytes(struct Reader *r, size_t len)
+{
+    const char *string;
+
+    if (r->error || len >= r->len - r->pos || r->data[r->pos + len] != '\0') {
+        r->error = true;
+        return NULL;
+    }
+    string = (const char*) r->data + r->pos;
+    r->pos += len + 1;
+    return string;
+}
+
+static const char *rd_string(struct Reader *r)
+{
+    uint32_t len = rd_u32(r);
+
+    return rd_bytes(r, len);
+}
+
+static const char *rd_signature(struct Reader *r)
+{
+    uint8_t len = rd_u8(r);
+
+    return rd_bytes(r, len);
+}
+
+static bool parse_message(struct Message *msg, const unsigned char *data, size_t len)
+{
+    struct Reader r;
+    size_t end;
+    uint8_t code;
+    const char *type;
+    const char *string;
+    uint32_t value;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->swap = data[0] == 'B';
+    msg->type = data[1];
+    msg->serial = read_u32_at(data + 8, msg->swap);
+    msg->data = data;
+    msg->len = len;
+
+    r.data = data;
+    r.len = len;
+    r.swap = msg->swap;
+    r.error = false;
+    r.pos = 12;
+    end = 16 + rd_u32(&r);
+
+    while (!r.error && r.pos < end) {
+        rd_align(&r, 8);
+        code = rd_u8(&r);
+        type = rd_signature(&r);
+        if (r.error)
+            break;
+
+        string = NULL;
+        value = 0;
+        if (strcmp(type, "s") == 0 || strcmp(type, "o") == 0)
+            string = rd_string(&r);
+        else if (strcmp(type, "g") == 0)
+            string = rd_signature(&r);
+        else if (strcmp(type, "u") == 0)
+            value = rd_u32(&r);
+        else
+            return false;
+
+        if (code == FIELD_REPLY_SERIAL)
+            msg->reply_serial = value;
+        else if (code == FIELD_ERROR_NAME)
+            msg->error_name = string;
+        else if (code == FIELD_INTERFACE)
+            msg->interface = string;
+        else if (code == FIELD_MEMBER)
+            msg->member = string;
+        else if (code == FIELD_SENDER)
+            msg->sender = string;
+        else if (code == FIELD_SIGNATURE)
+            msg->signature = string;
+    }
+
+    rd_align(&r, 8);
+    msg->body = r.pos;
+    if (msg->signature == NULL)
+        msg->signature = "";
+
+    return !r.error;
+}
+
+static struct Reader body_reader(struct Message *msg)
+{
+    struct Reader r;
+
+    r.data = msg->data;
+    r.pos = msg->body;
+    r.len = msg->len;
+    r.swap = msg->swap;
+    r.error = false;
+    return r;
+}
+
+/* transport */
+
+static void deadline_after(struct timespec *deadline, int timeout)
+{
+    if (timeout < 0)
+        timeout = WIRE_DEFAULT_TIMEOUT;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long) (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static int remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000L +
+         (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+
+    return ms < 0 ? 0 : (int) ms;
+}
+
+static double trace_begin(struct NotifyContext *ctx)
+{
+    struct timespec ts;
+
+    if (NULL == ctx->trace && NULL == ctx->metrics)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void trace_end(struct NotifyContext *ctx, int phase, double start)
+{
+    double ms;
+
+    if (NULL == ctx->trace && NULL == ctx->metrics)
+        return;
+
+    ms = trace_begin(ctx) - start;
+    if (ctx->trace != NULL)
+        ctx->trace->phase[phase] += ms;
+    if (ctx->metrics != NULL && phase == NOTIF_TRACE_MARSHAL)
+        _notif_metrics_observe(ctx->metrics, &ctx->metrics->marshal, ms);
+}
+
+static void observe_round_trip(struct NotifyContext *ctx, double sent)
+{
+    if (ctx->metrics != NULL)
+        _notif_metrics_observe(ctx->metrics, &ctx->metrics->round_trip, trace_begin(ctx) - sent);
+}
+
+/*
+ * Serials restart on the next connection, so queued calls still waiting
+ * for a reply fail now instead of being matched with new replies.
+ */
+static void disconnect(struct NotifyContext *ctx)
+{
+    struct PendingNotification *item;
+    unsigned int i;
+
+    for (i = 0; i < ctx->queue_count; ++i) {
+        item = &ctx->queue[(ctx->queue_head + i) % ctx->window];
+        if (item->done)
+            continue;
+        item->done = true;
+        item->id = -1;
+        item->error = strdup("Disconnected from the bus");
+        item->error_kind = NOTIF_ERROR_NO_BUS;
+    }
+
+    if (ctx->fd != -1)
+        close(ctx->fd);
+    ctx->fd = -1;
+    ctx->authenticated = false;
+    ctx->hello_done = false;
+    ctx->serial = 0;
+    ctx->in.len = 0;
+    ctx->in_consumed = 0;
+}
+
+static bool write_all(struct NotifyContext *ctx, const char *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = send(ctx->fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            create_error_message(ctx, NOTIF_ERROR_NO_BUS, "Disconnected from the bus");
+            disconnect(ctx);
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/* Assigns next serial to the message in buf and writes it */
+static bool send_message(struct NotifyContext *ctx, struct Buffer *buf)
+{
+    buf_set_u32(buf, 8, ++ctx->serial);
+    return write_all(ctx, buf->data, buf->len);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Copies address value of length len into out, decoding %XX escapes */
+static bool unescape_value(char *out, size_t size, const char *value, size_t len)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; ++i) {
+        if (n + 1 >= size)
+            return false;
+        if (value[i] == '%') {
+            if (i + 2 >= len || hex_value(value[i + 1]) < 0 || hex_value(value[i + 2]) < 0)
+                return false;
+            out[n++] = hex_value(value[i + 1]) * 16 + hex_value(value[i + 2]);
+            i += 2;
+        }
+        else {
+            out[n++] = value[i];
+        }
+    }
+    out[n] = '\0';
+    return true;
+}
+
+/* Connects to one "unix:path=..." or "unix:abstract=..." address */
+static int connect_unix(const char *address, size_t len)
+{
+    struct sockaddr_un addr;
+    const char *key, *value, *end = address + len;
+    size_t key_len, value_len, path_len;
+    bool abstract;
+    int fd;
+
+    if (len < 5 || strncmp(address, "unix:", 5) != 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    path_len = 0;
+    abstract = false;
+
+    for (key = address + 5; key < end; key = value + value_len + 1) {
+        value = memchr(key, '=', end - key);
+        if (value == NULL)
+            return -1;
+        key_len = value - key;
+        ++value;
+        value_len = strcspn(value, ",;");
+        if (value + value_len > end)
+            value_len = end - value;
+
+        if ((key_len == 4 && strncmp(key, "path", 4) == 0) ||
+            (key_len == 8 && strncmp(key, "abstract", 8) == 0)) {
+            abstract = key_len == 8;
+            if (!unescape_value(addr.sun_path + abstract, sizeof(addr.sun_path) - abstract,
+                                value, value_len))
+                return -1;
+            path_len = strlen(addr.sun_path + abstract) + abstract;
+        }
+    }
+
+    if (path_len == 0)
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*) &addr,
+                offsetof(struct sockaddr_un, sun_path) + path_len + !abstract) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Authentication and Hello are only written here. Their replies are
+ * read together with the reply to the first real call.
+ */
+static bool get_connection(struct NotifyContext *ctx)
+{
+    struct Buffer *buf = &ctx->out;
+    const char *address, *runtime;
+    char fallback[sizeof(((struct sockaddr_un*) 0)->sun_path) + 16];
+    char auth[64];
+    char uid[16];
+    size_t len, i, body;
+    double start;
+    int n;
+
+    if (ctx->fd != -1)
+        return true;
+
+    start = trace_begin(ctx);
+
+    address = getenv("DBUS_SESSION_BUS_ADDRESS");
+    if (address == NULL || address[0] == '\0') {
+        runtime = getenv("XDG_RUNTIME_DIR");
+        if (runtime == NULL) {
+            create_error_message(ctx, NOTIF_ERROR_NO_BUS,
+                                 "Connection Error (DBUS_SESSION_BUS_ADDRESS is not set)");
+            return false;
+        }
+        snprintf(fallback, sizeof(fallback), "unix:path=%s/bus", runtime);
+        address = fallback;
+    }
+
+    while (ctx->fd == -1 && *address != '\0') {
+        len = strcspn(address, ";");
+        ctx->fd = connect_unix(address, len);
+        address += len + (address[len] == ';');
+    }
+
+    if (ctx->fd == -1) {
+        create_error_message(ctx, NOTIF_ERROR_NO_BUS,
+                             "Connection Error (Cannot connect to the session bus)");
+        return false;
+    }
+
+    /* AUTH EXTERNAL with hex encoded uid */
+    n = snprintf(uid, sizeof(uid), "%u", (unsigned int) getuid());
+    len = snprintf(auth, sizeof(auth), "%cAUTH EXTERNAL ", '\0');
+    for (i = 0; i < (size_t) n; ++i)
+        len += snprintf(auth + len, sizeof(auth) - len, "%02x", (unsigned char) uid[i]);
+    len += snprintf(auth + len, sizeof(auth) - len, "\r\nBEGIN\r\n");
+
+    body = start_message(buf, MESSAGE_METHOD_CALL, 0,
+                         "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                         "org.freedesktop.DBus", "Hello", "");
+    end_message(buf, body);
+    if (buf->oom) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        disconnect(ctx);
+        return false;
+    }
+
+    if (!write_all(ctx, auth, len) || !send_message(ctx, buf))
+        return false;
+
+    _notif_metrics_connected(ctx->metrics, trace_begin(ctx) - start, ctx->connected);
+    ctx->connected = true;
+    return true;
+}
+
+/*
+ * Reads next message into msg, which stays valid until the next call.
+ * Returns 1 on message, 0 on timeout and -1 on error.
+ */
+static int read_message(struct NotifyContext *ctx, struct Message *msg, const struct timespec *deadline)
+{
+    struct Buffer *in = &ctx->in;
+    struct pollfd pfd;
+    const unsigned char *data;
+    char *line;
+    size_t need;
+    ssize_t ret;
+
+    if (ctx->in_consumed > 0) {
+        memmove(in->data, in->data + ctx->in_consumed, in->len - ctx->in_consumed);
+        in->len -= ctx->in_consumed;
+        ctx->in_consumed = 0;
+    }
+
+    for (;;) {
+        data = (const unsigned char*) in->data;
+
+        if (!ctx->authenticated) {
+            line = in->len > 0 ? memchr(in->data, '\n', in->len) : NULL;
+            if (line != NULL) {
+                if (in->len < 3 || strncmp(in->data, "OK ", 3) != 0) {
+                    create_error_message(ctx, NOTIF_ERROR_NO_BUS,
+                                         "Connection Error (Authentication failed)");
+                    disconnect(ctx);
+                    return -1;
+                }
+                need = line - in->data + 1;
+                memmove(in->data, in->data + need, in->len - need);
+                in->len -= need;
+                ctx->authenticated = true;
+                continue;
+            }
+        }
+        else if (in->len >= 16) {
+            if ((data[0] != 'l' && data[0] != 'B') || data[3] != 1) {
+                create_error_message(ctx, NOTIF_ERROR_OTHER, "Invalid message received");
+                disconnect(ctx);
+                return -1;
+            }
+            need = 16 + read_u32_at(data + 12, data[0] == 'B');
+            need = (need + 7) & ~(size_t) 7;
+            need += read_u32_at(data + 4, data[0] == 'B');
+            if (need > WIRE_MAX_MESSAGE) {
+                create_error_message(ctx, NOTIF_ERROR_OTHER, "Message too large");
+                disconnect(ctx);
+                return -1;
+            }
+            if (in->len >= need) {
+                ctx->in_consumed = need;
+                if (!parse_message(msg, data, need)) {
+                    create_error_message(ctx, NOTIF_ERROR_OTHER, "Invalid message received");
+                    disconnect(ctx);
+                    return -1;
+                }
+                return 1;
+            }
+            buf_reserve(in, need - in->len);
+        }
+
+        buf_reserve(in, 4096);
+        if (in->oom) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+            disconnect(ctx);
+            return -1;
+        }
+
+        pfd.fd = ctx->fd;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, remaining_ms(deadline));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0)
+            return 0;
+
+        ret = ret < 0 ? -1 : read(ctx->fd, in->data + in->len, in->size - in->len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            create_error_message(ctx, NOTIF_ERROR_NO_BUS, "Disconnected from the bus");
+            disconnect(ctx);
+            return -1;
+        }
+        in->len += ret;
+    }
+}
+
+static void reply_error(struct NotifyContext *ctx, struct Message *reply)
+{
+    struct Reader r = body_reader(reply);
+    const char *message = NULL;
+    char errorbuf[255];
+
+    if (reply->signature[0] == 's')
+        message = rd_string(&r);
+    snprintf(errorbuf, sizeof(errorbuf), "%s (%s)",
+             reply->error_name != NULL ? reply->error_name : "Error",
+             message != NULL ? message : "no message");
+    create_error_message(ctx, _notif_error_name_kind(reply->error_name), errorbuf);
+}
+
+static int get_reply_id(struct NotifyContext *ctx, struct Message *reply)
+{
+    struct Reader r = body_reader(reply);
+    uint32_t id;
+
+    if (reply->type == MESSAGE_ERROR) {
+        reply_error(ctx, reply);
+        return -1;
+    }
+
+    id = rd_u32(&r);
+    if (strcmp(reply->signature, "u") != 0 || r.error) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Invalid reply signature");
+        return -1;
+    }
+
+    _notif_server_seen(&ctx->server, reply->sender);
+    return (int) id;
+}
+
+static void timeout_error(struct NotifyContext *ctx)
+{
+    create_error_message(ctx, NOTIF_ERROR_TIMEOUT, "No reply within the reply timeout");
+}
+
+/* Stores reply into the queued notification it belongs to */
+static void dispatch_message(struct NotifyContext *ctx, struct Message *msg)
+{
+    struct PendingNotification *item;
+    unsigned int i;
+
+    if (msg->type != MESSAGE_METHOD_RETURN && msg->type != MESSAGE_ERROR)
+        return;
+
+    /* Hello is always the first message */
+    if (msg->reply_serial == 1) {
+        ctx->hello_done = true;
+        return;
+    }
+
+    for (i = 0; i < ctx->queue_count; ++i) {
+        item = &ctx->queue[(ctx->queue_head + i) % ctx->window];
+        if (item->serial != msg->reply_serial || item->done)
+            continue;
+
+        item->done = true;
+        observe_round_trip(ctx, item->sent);
+        item->id = get_reply_id(ctx, msg);
+        if (item->id == -1) {
+            item->error = strdup(ctx->error);
+            item->error_kind = ctx->error_kind;
+        }
+        return;
+    }
+}
+
+struct NotifyContext *_notif_create_context(void)
+{
+    struct NotifyContext *ctx;
+
+    ctx = (struct NotifyContext*) calloc(1, sizeof(struct NotifyContext));
+    if (NULL == ctx)
+        return NULL;
+
+    ctx->fd = -1;
+    ctx->timeout = -1;
+    ctx->window = NOTIF_DEFAULT_WINDOW;
+    return ctx;
+}
+
+void _notif_free_context(struct NotifyContext *ctx)
+{
+    struct Template *t = &ctx->template;
+
+    _notif_close_connection(ctx);
+
+    free(t->app_name);
+    free(t->icon);
+    free(t->category);
+    if (t->hints != NULL)
+        notif_free_data(t->hints);
+    free(t->prefix.data);
+    free(t->suffix[0].data);
+    free(t->suffix[1].data);
+    free(ctx->out.data);
+    free(ctx->in.data);
+    free(ctx->queue);
+    free(ctx->event_key);
+    image_cache_free(&ctx->images);
+    free(ctx->error);
+    free(ctx);
+}
+
+void _notif_set_private_connection(struct NotifyContext *ctx, bool private_conn)
+{
+    /* connections are never shared */
+    (void) ctx;
+    (void) private_conn;
+}
+
+/*
+ * Closing before the bus has processed authentication would drop
+ * messages sent without reply, so wait for the Hello reply first.
+ */
+void _notif_close_connection(struct NotifyContext *ctx)
+{
+    struct Message msg;
+    struct timespec deadline;
+
+    _notif_flush_queue(ctx);
+
+    deadline_after(&deadline, ctx->timeout);
+    while (ctx->fd != -1 && !ctx->hello_done &&
+           read_message(ctx, &msg, &deadline) == 1)
+        dispatch_message(ctx, &msg);
+
+    disconnect(ctx);
+}
+
+int _notif_build_message(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    return create_message(ctx, &ctx->out, data, 0) ? 0 : -1;
+}
+
+static int send_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    struct Message msg;
+    struct timespec deadline;
+    uint32_t serial;
+    double start, sent;
+    bool ok;
+    int ret;
+
+    start = trace_begin(ctx);
+    ok = get_connection(ctx);
+    trace_end(ctx, NOTIF_TRACE_CONNECT, start);
+    if (!ok)
+        return -1;
+
+    start = trace_begin(ctx);
+    ok = create_message(ctx, &ctx->out, data, 0);
+    trace_end(ctx, NOTIF_TRACE_MARSHAL, start);
+    if (!ok)
+        return -1;
+
+    start = sent = trace_begin(ctx);
+    ok = send_message(ctx, &ctx->out);
+    trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+    if (!ok)
+        return -1;
+    serial = ctx->serial;
+
+    deadline_after(&deadline, ctx->timeout);
+
+    start = trace_begin(ctx);
+    for (;;) {
+        ret = read_message(ctx, &msg, &deadline);
+        if (ret == 0) {
+            timeout_error(ctx);
+            return -1;
+        }
+        if (ret < 0)
+            return -1;
+
+        if (msg.reply_serial == serial &&
+            (msg.type == MESSAGE_METHOD_RETURN || msg.type == MESSAGE_ERROR)) {
+            trace_end(ctx, NOTIF_TRACE_REPLY, start);
+            observe_round_trip(ctx, sent);
+            if (ctx->trace != NULL)
+                ++ctx->trace->count;
+            return get_reply_id(ctx, &msg);
+        }
+
+        dispatch_message(ctx, &msg);
+    }
+}
+
+int _notif_send_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    int id = send_notification(ctx, data);
+
+    _notif_metrics_result(ctx->metrics, id, ctx->error_kind);
+    return id;
+}
+
+static int post_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    double start;
+    bool ok;
+
+    start = trace_begin(ctx);
+    ok = get_connection(ctx);
+    trace_end(ctx, NOTIF_TRACE_CONNECT, start);
+    if (!ok)
+        return -1;
+
+    start = trace_begin(ctx);
+    ok = create_message(ctx, &ctx->out, data, FLAG_NO_REPLY_EXPECTED);
+    trace_end(ctx, NOTIF_TRACE_MARSHAL, start);
+    if (!ok)
+        return -1;
+
+    start = trace_begin(ctx);
+    ok = send_message(ctx, &ctx->out);
+    trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+    if (!ok)
+        return -1;
+
+    if (ctx->trace != NULL)
+        ++ctx->trace->count;
+    return 0;
+}
+
+int _notif_post_notification(struct NotifyContext *ctx, struct NotifyData *data)
+{
+    int ret = post_notification(ctx, data);
+
+    _notif_metrics_posted(ctx->metrics, ret, ctx->error_kind);
+    return ret;
+}
+
+/*
+ * Errors of the notification server mean the notification is already
+ * gone, only errors from the bus itself (no server, no reply) count.
+ */
+static bool close_failed(struct NotifyContext *ctx, struct Message *reply)
+{
+    if (reply->type != MESSAGE_ERROR || reply->error_name == NULL ||
+        strncmp(reply->error_name, "org.freedesktop.DBus.Error.", 27) != 0)
+        return false;
+
+    create_error_message(ctx, _notif_error_name_kind(reply->error_name), reply->error_name);
+    return true;
+}
+
+int _notif_close_notifications(struct NotifyContext *ctx, const unsigned int *ids, unsigned int count)
+{
+    struct Buffer *buf = &ctx->out;
+    struct Message msg;
+    struct timespec deadline;
+    uint32_t first;
+    unsigned int i, replies;
+    size_t body;
+    int ret = 0, read;
+
+    if (count == 0)
+        return 0;
+
+    if (!get_connection(ctx))
+        return -1;
+
+    first = ctx->serial + 1;
+    for (i = 0; i < count; ++i) {
+        body = start_message(buf, MESSAGE_METHOD_CALL, 0,
+                             "org.freedesktop.Notifications",
+                             "/org/freedesktop/Notifications",
+                             "org.freedesktop.Notifications",
+                             "CloseNotification", "u");
+        buf_put_u32(buf, ids[i]);
+        end_message(buf, body);
+        if (buf->oom) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+            return -1;
+        }
+        if (!send_message(ctx, buf))
+            return -1;
+    }
+
+    deadline_after(&deadline, ctx->timeout);
+    for (replies = 0; replies < count; ) {
+        read = read_message(ctx, &msg, &deadline);
+        if (read == 0) {
+            timeout_error(ctx);
+            return -1;
+        }
+        if (read < 0)
+            return -1;
+
+        if ((msg.type == MESSAGE_METHOD_RETURN || msg.type == MESSAGE_ERROR) &&
+            msg.reply_serial >= first && msg.reply_serial - first < count) {
+            ++replies;
+            if (close_failed(ctx, &msg))
+                ret = -1;
+            continue;
+        }
+
+        dispatch_message(ctx, &msg);
+    }
+
+    return ret;
+}
+
+static bool complete_queue_head(struct NotifyContext *ctx, bool block)
+{
+    struct PendingNotification *head;
+    struct Message msg;
+    double start;
+    int ret;
+
+    if (ctx->queue_count == 0)
+        return false;
+
+    head = &ctx->queue[ctx->queue_head];
+
+    while (!head->done) {
+        if (!block)
+            return false;
+
+        start = trace_begin(ctx);
+        ret = ctx->fd == -1 ? -1 : read_message(ctx, &msg, &head->deadline);
+        trace_end(ctx, NOTIF_TRACE_REPLY, start);
+        if (ret == 1) {
+            dispatch_message(ctx, &msg);
+            continue;
+        }
+
+        if (ret == 0)
+            timeout_error(ctx);
+        else if (ctx->fd == -1 && ctx->error == NULL)
+            create_error_message(ctx, NOTIF_ERROR_NO_BUS, "Disconnected from the bus");
+
+        head->done = true;
+        head->id = -1;
+        head->error = strdup(ctx->error);
+        head->error_kind = ctx->error_kind;
+    }
+
+    ctx->queue_head = (ctx->queue_head + 1) % ctx->window;
+    --ctx->queue_count;
+
+    if (head->error != NULL) {
+        create_error_message(ctx, head->error_kind, head->error);
+        free(head->error);
+    }
+
+    _notif_metrics_result(ctx->metrics, head->id, ctx->error_kind);
+    head->callback(head->data, head->id, head->user_data);
+    return true;
+}
+
+void _notif_set_window_size(struct NotifyContext *ctx, unsigned int size)
+{
+    if (size == 0)
+        size = 1;
+
+    /* window can only be resized while nothing is in flight */
+    _notif_flush_queue(ctx);
+
+    free(ctx->queue);
+    ctx->queue = NULL;
+    ctx->queue_head = 0;
+    ctx->window = size;
+}
+
+void _notif_set_reply_timeout(struct NotifyContext *ctx, int timeout)
+{
+    ctx->timeout = timeout;
+}
+
+static int queue_notification(struct NotifyContext *ctx, struct NotifyData *data,
+                              NotifyCallback callback, void *user_data)
+{
+    struct PendingNotification *item;
+    struct Message msg;
+    struct timespec now;
+    double start;
+    bool ok;
+
+    start = trace_begin(ctx);
+    ok = get_connection(ctx);
+    trace_end(ctx, NOTIF_TRACE_CONNECT, start);
+    if (!ok)
+        return -1;
+
+    if (NULL == ctx->queue) {
+        ctx->queue = (struct PendingNotification*) malloc(ctx->window * sizeof(struct PendingNotification));
+        if (NULL == ctx->queue) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+            return -1;
+        }
+    }
+
+    /* wait for the oldest call when the window is full */
+    if (ctx->queue_count == ctx->window)
+        complete_queue_head(ctx, true);
+
+    start = trace_begin(ctx);
+    ok = create_message(ctx, &ctx->out, data, 0);
+    trace_end(ctx, NOTIF_TRACE_MARSHAL, start);
+    if (!ok)
+        return -1;
+
+    start = trace_begin(ctx);
+    ok = send_message(ctx, &ctx->out);
+    trace_end(ctx, NOTIF_TRACE_FLUSH, start);
+    if (!ok)
+        return -1;
+
+    item = &ctx->queue[(ctx->queue_head + ctx->queue_count) % ctx->window];
+    item->serial = ctx->serial;
+    item->sent = start;
+    item->done = false;
+    item->id = -1;
+    item->error = NULL;
+    item->data = data;
+    item->callback = callback;
+    item->user_data = user_data;
+    deadline_after(&item->deadline, ctx->timeout);
+    ++ctx->queue_count;
+
+    if (ctx->trace != NULL)
+        ++ctx->trace->count;
+
+    /* collect replies that already arrived */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (read_message(ctx, &msg, &now) == 1)
+        dispatch_message(ctx, &msg);
+    while (complete_queue_head(ctx, false))
+        ;
+
+    return 0;
+}
+
+int _notif_queue_notification(struct NotifyContext *ctx, struct NotifyData *data,
+                              NotifyCallback callback, void *user_data)
+{
+    int ret = queue_notification(ctx, data, callback, user_data);
+
+    if (ret != 0)
+        _notif_metrics_result(ctx->metrics, -1, ctx->error_kind);
+    return ret;
+}
+
+void _notif_flush_queue(struct NotifyContext *ctx)
+{
+    while (complete_queue_head(ctx, true))
+        ;
+}
+
+static bool send_server_call(struct NotifyContext *ctx, const char *method)
+{
+    struct Buffer *buf = &ctx->out;
+    size_t body;
+
+    body = start_message(buf, MESSAGE_METHOD_CALL, 0,
+                         "org.freedesktop.Notifications",
+                         "/org/freedesktop/Notifications",
+                         "org.freedesktop.Notifications",
+                         method, "");
+    end_message(buf, body);
+    if (buf->oom) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return false;
+    }
+    return send_message(ctx, buf);
+}
+
+static bool read_capabilities(struct Message *reply, struct NotifyServerInfo *info)
+{
+    struct Reader r = body_reader(reply);
+    const char *cap;
+    size_t end;
+
+    if (strcmp(reply->signature, "as") != 0)
+        return false;
+
+    end = rd_u32(&r);
+    end += r.pos;
+    while (!r.error && r.pos < end) {
+        cap = rd_string(&r);
+        if (cap != NULL)
+            info->capabilities |= notif_capability(cap);
+    }
+    return !r.error;
+}
+
+static bool read_server_information(struct Message *reply, struct NotifyServerInfo *info)
+{
+    struct Reader r = body_reader(reply);
+    const char *name, *vendor, *version, *spec_version;
+
+    if (strcmp(reply->signature, "ssss") != 0)
+        return false;
+
+    name = rd_string(&r);
+    vendor = rd_string(&r);
+    version = rd_string(&r);
+    spec_version = rd_string(&r);
+    if (r.error)
+        return false;
+
+    _notif_copy_info(info->name, name);
+    _notif_copy_info(info->vendor, vendor);
+    _notif_copy_info(info->version, version);
+    _notif_copy_info(info->spec_version, spec_version);
+    return true;
+}
+
+/* Both calls are sent before waiting, so asking costs one round trip */
+static bool query_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info)
+{
+    struct Message msg;
+    struct timespec deadline;
+    uint32_t first;
+    unsigned int replies;
+    bool ok = true;
+    int ret;
+
+    if (!get_connection(ctx))
+        return false;
+
+    first = ctx->serial + 1;
+    if (!send_server_call(ctx, "GetCapabilities") ||
+        !send_server_call(ctx, "GetServerInformation"))
+        return false;
+
+    memset(info, 0, sizeof(*info));
+    deadline_after(&deadline, ctx->timeout);
+    for (replies = 0; replies < 2; ) {
+        ret = read_message(ctx, &msg, &deadline);
+        if (ret == 0) {
+            timeout_error(ctx);
+            return false;
+        }
+        if (ret < 0)
+            return false;
+
+        if ((msg.type != MESSAGE_METHOD_RETURN && msg.type != MESSAGE_ERROR) ||
+            (msg.reply_serial != first && msg.reply_serial != first + 1)) {
+            dispatch_message(ctx, &msg);
+            continue;
+        }
+
+        ++replies;
+        if (!ok)
+            continue;
+        if (msg.type == MESSAGE_ERROR) {
+            reply_error(ctx, &msg);
+            ok = false;
+            continue;
+        }
+
+        /* strings point into the input buffer, copy them right away */
+        _notif_copy_info(info->owner, msg.sender);
+        if (!(msg.reply_serial == first ? read_capabilities(&msg, info)
+                                        : read_server_information(&msg, info))) {
+            create_error_message(ctx, NOTIF_ERROR_OTHER, "Invalid reply signature");
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+int _notif_get_server_info(struct NotifyContext *ctx, struct NotifyServerInfo *info)
+{
+    if (!ctx->server.valid) {
+        if (!query_server_info(ctx, &ctx->server.info))
+            return -1;
+        ctx->server.valid = true;
+    }
+
+    *info = ctx->server.info;
+    return 0;
+}
+
+void _notif_set_server_info(struct NotifyContext *ctx, const struct NotifyServerInfo *info)
+{
+    ctx->server.info = *info;
+    ctx->server.valid = true;
+}
+
+bool _notif_has_server_info(struct NotifyContext *ctx)
+{
+    return ctx->server.valid;
+}
+
+/*
+ * The bus cannot match uint32 arguments, so the rule covers all
+ * signals of the notification server and ids are checked on receipt.
+ * Signals of other clients' notifications still wake us, but nothing
+ * else on the bus does.
+ */
+int _notif_watch_events(struct NotifyContext *ctx)
+{
+    struct Buffer *buf = &ctx->out;
+    struct Message msg;
+    struct timespec deadline;
+    char errorbuf[255];
+    uint32_t serial;
+    size_t body;
+    int ret;
+
+    if (!get_connection(ctx))
+        return -1;
+
+    body = start_message(buf, MESSAGE_METHOD_CALL, 0,
+                         "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                         "org.freedesktop.DBus", "AddMatch", "s");
+    buf_put_string(buf, NOTIF_MATCH_RULE);
+    end_message(buf, body);
+    if (buf->oom) {
+        create_error_message(ctx, NOTIF_ERROR_OTHER, "Out Of Memory!");
+        return -1;
+    }
+
+    if (!send_message(ctx, buf))
+        return -1;
+    serial = ctx->serial;
+
+    deadline_after(&deadline, ctx->timeout);
+    for (;;) {
+        ret = read_message(ctx, &msg, &deadline);
+        if (ret == 0) {
+            timeout_error(ctx);
+            return -1;
+        }
+        if (ret < 0)
+            return -1;
+
+        if (msg.reply_serial == serial && msg.type == MESSAGE_ERROR) {
+            snprintf(errorbuf, sizeof(errorbuf), "AddMatch Error (%s)",
+                     msg.error_name != NULL ? msg.error_name : "Error");
+            create_error_message(ctx, NOTIF_ERROR_OTHER, errorbuf);
+            return -1;
+        }
+        if (msg.reply_serial == serial && msg.type == MESSAGE_METHOD_RETURN)
+            return 0;
+
+        dispatch_message(ctx, &msg);
+    }
+}
+
+/* Returns true when msg is a signal for notification id */
+static bool read_event(struct NotifyContext *ctx, struct Message *msg,
+                       unsigned int id, struct NotifyEvent *event)
+{
+    struct Reader r = body_reader(msg);
+    const char *key;
+
+    if (msg->type != MESSAGE_SIGNAL || msg->interface == NULL || msg->member == NULL ||
+        strcmp(msg->interface, NOTIF_INTERFACE) != 0)
+        return false;
+
+    if (strcmp(msg->member, "ActionInvoked") == 0 && strcmp(msg->signature, "us") == 0) {
+        if (rd_u32(&r) != id)
+            return false;
+        key = rd_string(&r);
+        if (r.error)
+            return false;
+
+        free(ctx->event_key);
+        ctx->event_key = strdup(key);
+        event->type = NOTIF_EVENT_ACTION;
+        event->key = ctx->event_key != NULL ? ctx->event_key : "";
+        event->reason = 0;
+    }
+    else if (strcmp(msg->member, "NotificationClosed") == 0 && strcmp(msg->signature, "uu") == 0) {
+        if (rd_u32(&r) != id)
+            return false;
+
+        event->type = NOTIF_EVENT_CLOSED;
+        event->key = NULL;
+        event->reason = rd_u32(&r);
+        if (r.error)
+            return false;
+    }
+    else {
+        return false;
+    }
+
+    event->id = id;
+    return true;
+}
+
+/*
+ * Blocks in poll() on the bus socket, replies of queued notifications
+ * that arrive meanwhile are dispatched as usual.
+ */
+int _notif_wait_event(struct NotifyContext *ctx, unsigned int id,
+                      struct NotifyEvent *event, int timeout)
+{
+    struct Message msg;
+    struct timespec deadline;
+    int ret;
+
+    if (!get_connection(ctx))
+        return -1;
+
+    /* without timeout, wait in rounds of an hour */
+    deadline_after(&deadline, timeout < 0 ? 3600000 : timeout);
+    for (;;) {
+        ret = read_message(ctx, &msg, &deadline);
+        if (ret == 0 && timeout < 0) {
+            deadline_after(&deadline, 3600000);
+            continue;
+        }
+        if (ret <= 0)
+            return ret;
+
+        if (read_event(ctx, &msg, id, event))
+            return 1;
+
+        dispatch_message(ctx, &msg);
+    }
+}
+
+/*
+ * Phase times are added to the trace until it is unset with NULL.
+ * Messages are written unbuffered, so the flush phase is the write
+ * of the message itself.
+ */
+void _notif_set_trace(struct NotifyContext *ctx, struct NotifyTrace *trace)
+{
+    ctx->trace = trace;
+}
+
+void _notif_set_metrics(struct NotifyContext *ctx, struct NotifyMetrics *metrics)
+{
+    ctx->metrics = metrics;
+}
+
+const char *_notif_get_error_message(struct NotifyContext *ctx)
+{
+    return ctx->error;
+}
+
+int _notif_get_error_kind(struct NotifyContext *ctx)
+{
+    return ctx->error != NULL ? ctx->error_kind : 0;
+}
+
+void _notif_free_error_message(struct NotifyContext *ctx)
+{
+    free(ctx->error);
+    ctx->error = NULL;
+}